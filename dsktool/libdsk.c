@@ -0,0 +1,3866 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <malloc.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include "libdsk.h"
+#include "msxboot.h"
+#ifdef HAVE_ZLIB
+#   include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#   include <zstd.h>
+#endif
+
+#ifdef WIN32
+#   define localtime_r(T,Tm) (localtime_s(Tm,T) ? NULL : Tm)
+#   define OPEN_FLAGS O_WRONLY|O_CREAT|O_TRUNC|O_BINARY
+#   define MKDIR(P) mkdir(P)
+#   define FSEEK64(F,O) _fseeki64(F,O,SEEK_SET)
+#   include <direct.h>
+#else
+#   define OPEN_FLAGS O_WRONLY|O_CREAT|O_TRUNC
+#   define MKDIR(P) mkdir(P, 0777)
+#   define FSEEK64(F,O) fseeko(F,O,SEEK_SET)
+#   include <sys/mman.h>
+#   include <pthread.h>
+#endif
+
+#define ADD_READERS 4				// Threads reading the host files of an A command
+
+// Plan for one host file of an A command
+typedef struct {
+	char         fullname[250];
+	char         name[250];
+	uint8_t      dirname[11];		// Padded 8.3 name as stored in the directory
+	uint32_t     size;
+	time_t       mtime;
+	uint8_t      found;				// Updating an existing file
+	uint8_t      skip;				// Superseded by a later file with the same name (or a directory)
+	uint8_t      isdir;				// Host directory, added after the files
+	uint16_t     first;
+	extentmap_t *map;
+	int          status;
+} addplan_t;
+
+
+static void unpack_fat (DskImage *img);
+static void build_freemap (DskImage *img);
+static void pack_free (DskImage *img);
+static int  add_host_dir (DskImage *img, uint16_t parent, char *path, char *name);
+static int  add_planned (DskImage *img, uint16_t dirclus, char **names, int num, uint8_t checked);
+
+// Create an empty image handle
+DskImage *new_dsk (FILE *out) {
+	DskImage *img;
+
+	img = (DskImage *) calloc(1, sizeof(DskImage));
+	img->out = out ? out : stdout;
+	img->dskFormat = FORMAT_720;
+	img->dskfd = -1;
+	img->cachebudget = CACHE_BUDGET;
+	img->packlevel = PACK_LEVEL;
+	return img;
+}
+
+// Release the extent maps, the directory indexes and the cluster owners: built again when needed
+static void drop_caches (DskImage *img) {
+	uint32_t i;
+
+	if (img->extentcache != NULL) {
+		for (i=0; i<2+img->fatelements; i++) {
+			free(img->extentcache[i].runs);
+		}
+		free(img->extentcache);
+		img->extentcache = NULL;
+	}
+	if (img->dirs != NULL) {
+		for (i=0; i<2+img->fatelements; i++) {
+			if (img->dirs[i] == NULL) continue;
+			free(img->dirs[i]->clusters);
+			free(img->dirs[i]->hashhead);
+			free(img->dirs[i]->hashnext);
+			free(img->dirs[i]);
+		}
+		free(img->dirs);
+		img->dirs = NULL;
+	}
+	free(img->clusterowner);
+	free(img->clusterindex);
+	free(img->clusterdir);
+	img->clusterowner = NULL;
+	img->clusterindex = NULL;
+	img->clusterdir = NULL;
+}
+
+// Release an image handle and everything it holds
+void free_dsk (DskImage *img) {
+	drop_caches(img);
+#ifndef WIN32
+	if (img->dskmapped || img->dskcached)
+		munmap(img->mapbase, img->maplen);
+	else
+#endif
+		free(img->dskimage);
+	if (img->dskfd != -1) close(img->dskfd);
+	pack_free(img);
+	free(img->dirtymap);
+	free(img->cacheres);
+	free(img->cacheprev);
+	free(img->cachenext);
+	free(img->fatcache);
+	free(img->freemap);
+	free(img->freedmap);
+	free(img);
+}
+
+// Create a disk in memory of specified format
+static int create_boot (DskImage *img) {
+	bootsec_t *bootsec;
+
+	//Copy default boot sector
+	bootsec = img->bootsec = (bootsec_t *)malloc(512);
+	memcpy(bootsec, msxboot720, sizeof(msxboot720));
+
+
+	//Check format size & personalize boot params
+	switch (img->dskFormat) {
+		case 360:
+			bootsec->totalSectors = 720;
+			bootsec->mediaDescriptor = 0xF8;
+			bootsec->sectorsPerFAT = 2;
+			bootsec->numberOfHeads = 1;
+			break;
+		case 720:
+			break;
+		case 1440:
+			bootsec->sectorsPerCluster = 1;
+			bootsec->maxDirectoryEntries = 224;
+			bootsec->totalSectors = 2880;
+			bootsec->mediaDescriptor = 0xF0;
+			bootsec->sectorsPerFAT = 9;
+			bootsec->sectorsPerTrack = 18;
+			break;
+		case 2880:
+			bootsec->maxDirectoryEntries = 224;
+			bootsec->totalSectors = 5760;
+			bootsec->mediaDescriptor = 0xF0;
+			bootsec->sectorsPerFAT = 9;
+			bootsec->sectorsPerTrack = 36;
+			break;
+		default:
+			fputs("ERROR bad format size. Only 360, 720, 1440, 2880 are supported!\n\n", img->out);
+			free(bootsec);
+			img->bootsec = NULL;
+			return DSK_ERR_FORMAT;
+	}
+	return DSK_OK;
+}
+
+
+// XSA compression (XelaSoft LZ77 with an adaptive Huffman coded distance)
+#define XSA_TBLSIZE   16			// Distance codes
+#define XSA_MAXSTRLEN 254			// Longest string (255 marks the end of the data)
+#define XSA_MAXHUFCNT 127			// Distance codes between two Huffman table updates
+#define XSA_WINDOW    8192			// Farthest distance used by the encoder
+
+//Compressed image containers
+#define PACK_XSA      1
+#define PACK_GZIP     2
+#define PACK_ZSTD     3
+#define PACK_OVERLAY  4				// Not compressed: the sectors modified over a read-only base image
+#define PACK_IOBUF    (64*1024)			// Compressed data read or written at once
+#define OVL_MAGIC     "DSKOVL\x1A"
+#define DLT_MAGIC     "DSKDLT\x1A"			// Delta between two images: an overlay without base, with the hashes of the old sectors
+
+// Header of an overlay image, followed by the base image name, the numbers of the sectors stored and their data
+typedef struct {
+	char     magic[8];
+	uint32_t size;						// Size of the base image
+	uint16_t bytesPerSector;
+	uint16_t namelen;					// Length of the base image name
+	uint32_t sectors;					// Sectors stored in the overlay
+} ovlheader_t;
+
+// Extra bits of each distance code
+static const uint8_t xsa_cpdext[XSA_TBLSIZE] = { 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 0, 0 };
+
+// Adaptive Huffman tree of the distance codes, rebuilt after XSA_MAXHUFCNT+1 codes
+typedef struct {
+	int16_t  weight[2*XSA_TBLSIZE-1];
+	int8_t   child1[2*XSA_TBLSIZE-1];	// Bit 1 (-1 for the leaves)
+	int8_t   child2[2*XSA_TBLSIZE-1];	// Bit 0
+	uint16_t tblsizes[XSA_TBLSIZE];		// Uses of each code since the last update
+	uint8_t  updhufcnt;
+	uint16_t cpdist[XSA_TBLSIZE+1];		// First distance of each code
+	uint16_t code[XSA_TBLSIZE];			// Bits of each code, first one in the LSB
+	uint8_t  codelen[XSA_TBLSIZE];
+	uint8_t  lookup[256];				// Code and length (code<<4|len) for the next 8 bits, 0xFF if longer
+} xsahuf_t;
+
+// Compressed image being decoded (or overlay over its base image): the input is read in chunks and decoded on demand straight into the image
+struct pack_s {
+	uint8_t  type;						// PACK_XSA, PACK_GZIP, PACK_ZSTD or PACK_OVERLAY
+	FILE    *file;
+	uint8_t  in[PACK_IOBUF];
+	uint32_t inpos, inlen;
+	uint32_t outlen;					// Bytes of the image decoded so far
+	uint32_t size;						// Original size
+	uint8_t  done, error;
+	char     name[256];					// Original file name stored in the header
+	uint8_t  bitflg, bitcnt;			// XSA flag bits
+	xsahuf_t huf;
+	uint32_t *ovlsec;					// Overlay: sectors stored over the base image, and their data
+	uint8_t  *ovldata;
+	uint32_t  ovlnum;
+	uint16_t  ovlbps;
+#ifdef HAVE_ZLIB
+	z_stream  gz;
+	gz_header gzhead;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DStream *zd;
+#endif
+};
+
+// Build the Huffman tree from the code counts, and its code and lookup tables
+static void xsa_mkhuftbl (xsahuf_t *h) {
+	int      i, p, l1, l2, w, n, depth;
+	int8_t   stack[2*XSA_TBLSIZE];
+	uint16_t bits[2*XSA_TBLSIZE-1];
+	uint8_t  len[2*XSA_TBLSIZE-1];
+
+	for (i=0; i<XSA_TBLSIZE; i++) {
+		h->weight[i] = 1 + (h->tblsizes[i] >>= 1);
+	}
+	for (; i<2*XSA_TBLSIZE-1; i++) {
+		h->weight[i] = -1;
+	}
+	//Join the two lightest nodes until the root is placed
+	while (h->weight[2*XSA_TBLSIZE-2] == -1) {
+		for (p=0; !h->weight[p]; p++);
+		l1 = p++;
+		while (!h->weight[p]) p++;
+		if (h->weight[p] < h->weight[l1]) {
+			l2 = l1;
+			l1 = p++;
+		} else {
+			l2 = p++;
+		}
+		while ((w = h->weight[p]) != -1) {
+			if (w) {
+				if (w < h->weight[l1]) {
+					l2 = l1;
+					l1 = p;
+				} else if (w < h->weight[l2]) {
+					l2 = p;
+				}
+			}
+			p++;
+		}
+		h->weight[p] = h->weight[l1] + h->weight[l2];
+		h->child1[p] = l1;
+		h->child2[p] = l2;
+		h->weight[l1] = h->weight[l2] = 0;
+	}
+	h->updhufcnt = XSA_MAXHUFCNT;
+
+	//Codes of the leaves, walking the tree from the root
+	memset(h->lookup, 0xFF, sizeof(h->lookup));
+	n = 0;
+	stack[n++] = 2*XSA_TBLSIZE-2;
+	bits[2*XSA_TBLSIZE-2] = 0;
+	len[2*XSA_TBLSIZE-2] = 0;
+	while (n) {
+		p = stack[--n];
+		depth = len[p];
+		if (h->child1[p] != -1) {
+			bits[h->child1[p]] = bits[p] | (1<<depth);
+			bits[h->child2[p]] = bits[p];
+			len[h->child1[p]] = len[h->child2[p]] = depth+1;
+			stack[n++] = h->child1[p];
+			stack[n++] = h->child2[p];
+			continue;
+		}
+		h->code[p] = bits[p];
+		h->codelen[p] = depth;
+		if (depth <= 8) {
+			for (i=bits[p]; i<256; i+=1<<depth) {
+				h->lookup[i] = p<<4 | depth;
+			}
+		}
+	}
+}
+
+// Initial state of the distance coding
+static void xsa_inithuf (xsahuf_t *h) {
+	uint32_t i, offs = 1;
+
+	for (i=0; i<XSA_TBLSIZE; i++) {
+		h->cpdist[i] = offs;
+		offs += 1 << xsa_cpdext[i];
+		h->tblsizes[i] = 0;
+		h->child1[i] = -1;
+	}
+	h->cpdist[XSA_TBLSIZE] = offs;
+	xsa_mkhuftbl(h);
+}
+
+// Next byte of the compressed stream
+static uint8_t xsa_in (struct pack_s *x) {
+	if (x->inpos == x->inlen) {
+		x->inlen = fread(x->in, 1, PACK_IOBUF, x->file);
+		x->inpos = 0;
+		if (!x->inlen) {
+			x->error = 1;
+			return 0;
+		}
+	}
+	return x->in[x->inpos++];
+}
+
+// Next byte of the compressed stream, without taking it
+static uint8_t xsa_peek (struct pack_s *x) {
+	if (x->inpos == x->inlen) {
+		x->inlen = fread(x->in, 1, PACK_IOBUF, x->file);
+		x->inpos = 0;
+		if (!x->inlen) return 0;
+	}
+	return x->in[x->inpos];
+}
+
+// Next flag bit: the flag bytes are taken from the stream when the previous one runs out
+static uint8_t xsa_bit (struct pack_s *x) {
+	uint8_t bit;
+
+	if (!x->bitcnt) {
+		x->bitflg = xsa_in(x);
+		x->bitcnt = 8;
+	}
+	bit = x->bitflg & 1;
+	x->bitflg >>= 1;
+	x->bitcnt--;
+	return bit;
+}
+
+// Next bits of a value, most significant first
+static uint32_t xsa_bits (struct pack_s *x, uint8_t n) {
+	uint32_t value = 0;
+
+	while (n--) {
+		value = (value<<1) | xsa_bit(x);
+	}
+	return value;
+}
+
+// Length of a string (XSA_MAXSTRLEN+1 for the end of the data)
+static uint32_t xsa_strlen (struct pack_s *x) {
+	uint32_t len = 1;
+	uint8_t  nbits = 2;
+
+	if (!xsa_bit(x)) return 2;
+	if (!xsa_bit(x)) return 3;
+	if (!xsa_bit(x)) return 4;
+	while (nbits!=7 && xsa_bit(x)) nbits++;
+	return (len<<nbits | xsa_bits(x, nbits)) + 1;
+}
+
+// Distance of a string: Huffman coded distance code and its extra bits
+static uint32_t xsa_strpos (struct pack_s *x) {
+	xsahuf_t *h = &x->huf;
+	uint32_t  peek, entry, pos;
+	uint8_t   code, len;
+	int       p;
+
+	//The code never spans raw bytes, so the next flag byte can be looked at before it's needed
+	peek = x->bitflg;
+	if (x->bitcnt < 8) peek |= xsa_peek(x) << x->bitcnt;
+	entry = h->lookup[peek & 0xFF];
+	if (entry != 0xFF) {
+		code = entry>>4;
+		len = entry&0xF;
+		if (len <= x->bitcnt) {
+			x->bitflg >>= len;
+			x->bitcnt -= len;
+		} else {
+			len -= x->bitcnt;
+			x->bitflg = xsa_in(x) >> len;
+			x->bitcnt = 8-len;
+		}
+	} else {
+		for (p=2*XSA_TBLSIZE-2; h->child1[p] != -1; ) {
+			p = xsa_bit(x) ? h->child1[p] : h->child2[p];
+		}
+		code = p;
+	}
+	h->tblsizes[code]++;
+
+	if (xsa_cpdext[code] >= 8) {
+		pos = xsa_in(x);
+		pos |= xsa_bits(x, xsa_cpdext[code]-8) << 8;
+	} else {
+		pos = xsa_bits(x, xsa_cpdext[code]);
+	}
+	//The tree is rebuilt after the code that uses up the count, as the reference decoder does
+	if (h->updhufcnt-- == 0)
+		xsa_mkhuftbl(h);
+	return pos + h->cpdist[code];
+}
+
+// Decode a XSA image up to the specified offset
+static void xsa_decode (DskImage *img, uint32_t upto) {
+	struct pack_s *x = img->pack;
+	uint8_t       *out = img->dskimage;
+	uint32_t       len, dist;
+
+	while (!x->done && x->outlen < upto) {
+		if (!xsa_bit(x)) {
+			out[x->outlen++] = xsa_in(x);
+		} else if ((len = xsa_strlen(x)) == XSA_MAXSTRLEN+1) {
+			x->done = 1;
+		} else {
+			dist = xsa_strpos(x);
+			if (dist > x->outlen || x->outlen+len > x->size) {
+				x->error = 1;
+				break;
+			}
+			for (; len; len--, x->outlen++) {
+				out[x->outlen] = out[x->outlen-dist];
+			}
+		}
+		if (x->error) break;
+	}
+}
+
+// Read the header of a XSA image
+static int xsa_open (DskImage *img, FILE *file) {
+	struct pack_s *x;
+	uint8_t  head[8];
+	uint32_t i;
+	int      c;
+
+	if (fread(head, 1, 8, file) != 8) return 0;
+	x = img->pack = (struct pack_s *) calloc(1, sizeof(struct pack_s));
+	x->type = PACK_XSA;
+	x->file = file;
+	memcpy(&x->size, head+4, 4);
+	x->size = (x->size+511) & ~511;
+	//Skip the compressed size, then keep the original name
+	for (i=0; i<4; i++) fgetc(file);
+	for (i=0; (c=fgetc(file)) > 0; ) {
+		if (i<sizeof(x->name)-1) x->name[i++] = c;
+	}
+	xsa_inithuf(&x->huf);
+	return 1;
+}
+
+#ifdef HAVE_ZLIB
+// Prepare the decoder of a gzip image, the size comes from the trailer
+static int gz_open (DskImage *img, FILE *file) {
+	struct pack_s *p;
+	uint8_t tail[4];
+
+	if (fseek(file, -4, SEEK_END) || fread(tail, 1, 4, file) != 4) return 0;
+	rewind(file);
+	p = img->pack = (struct pack_s *) calloc(1, sizeof(struct pack_s));
+	p->type = PACK_GZIP;
+	p->file = file;
+	memcpy(&p->size, tail, 4);
+	if (inflateInit2(&p->gz, 15+16) != Z_OK) return 0;
+	p->gzhead.name = (Bytef *) p->name;
+	p->gzhead.name_max = sizeof(p->name)-1;
+	inflateGetHeader(&p->gz, &p->gzhead);
+	return 1;
+}
+
+// Inflate a gzip image up to the specified offset
+static void gz_decode (DskImage *img, uint32_t upto) {
+	struct pack_s *p = img->pack;
+	z_stream      *z = &p->gz;
+	int            ret;
+
+	z->next_out = img->dskimage + p->outlen;
+	z->avail_out = upto - p->outlen;
+	while (z->avail_out && !p->done) {
+		if (!z->avail_in) {
+			if (!(p->inlen = fread(p->in, 1, PACK_IOBUF, p->file))) {
+				p->error = 1;
+				break;
+			}
+			z->next_in = p->in;
+			z->avail_in = p->inlen;
+		}
+		ret = inflate(z, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			p->done = 1;
+		} else if (ret != Z_OK) {
+			p->error = 1;
+			break;
+		}
+	}
+	p->outlen = z->next_out - img->dskimage;
+}
+
+// Deflate the image to a gzip file
+static int gz_write (DskImage *img, FILE *file, uint8_t *data, uint32_t size, char *name) {
+	z_stream  z;
+	gz_header head;
+	uint8_t  *buf = (uint8_t *) malloc(PACK_IOBUF);
+	uint8_t   level = img->packlevel<1 ? 1 : img->packlevel>9 ? 9 : img->packlevel;
+	uint32_t  n;
+	int       ret;
+
+	memset(&z, 0, sizeof(z));
+	memset(&head, 0, sizeof(head));
+	head.name = (Bytef *) name;
+	head.os = 3;
+	if (deflateInit2(&z, level, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(buf);
+		return DSK_ERR_IMAGE;
+	}
+	deflateSetHeader(&z, &head);
+	z.next_in = data;
+	z.avail_in = size;
+	do {
+		z.next_out = buf;
+		z.avail_out = PACK_IOBUF;
+		ret = deflate(&z, Z_FINISH);
+		n = PACK_IOBUF - z.avail_out;
+		if (n && fwrite(buf, 1, n, file) != n) ret = Z_ERRNO;
+	} while (ret == Z_OK);
+	deflateEnd(&z);
+	free(buf);
+	return ret==Z_STREAM_END ? DSK_OK : DSK_ERR_IMAGE;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+// Prepare the decoder of a zstd image, the size comes from the frame header
+static int zst_open (DskImage *img, FILE *file) {
+	struct pack_s *p;
+	uint8_t head[18];			// largest frame header
+	unsigned long long size;
+	size_t n;
+
+	n = fread(head, 1, sizeof(head), file);
+	rewind(file);
+	size = ZSTD_getFrameContentSize(head, n);
+	if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR || size > 0xFFFFFFFF) {
+		fprintf(img->out, "ERROR .ZST image without its original size\n");
+		return 0;
+	}
+	p = img->pack = (struct pack_s *) calloc(1, sizeof(struct pack_s));
+	p->type = PACK_ZSTD;
+	p->file = file;
+	p->size = size;
+	p->zd = ZSTD_createDStream();
+	ZSTD_initDStream(p->zd);
+	return 1;
+}
+
+// Decompress a zstd image up to the specified offset
+static void zst_decode (DskImage *img, uint32_t upto) {
+	struct pack_s *p = img->pack;
+	ZSTD_outBuffer out = { img->dskimage, upto, p->outlen };
+	ZSTD_inBuffer  in = { p->in, p->inlen, p->inpos };
+	size_t         ret;
+
+	while (out.pos < out.size && !p->done) {
+		if (in.pos == in.size) {
+			if (!(in.size = fread(p->in, 1, PACK_IOBUF, p->file))) {
+				p->error = 1;
+				break;
+			}
+			in.pos = 0;
+		}
+		ret = ZSTD_decompressStream(p->zd, &out, &in);
+		if (ZSTD_isError(ret)) {
+			p->error = 1;
+			break;
+		}
+		if (!ret) p->done = 1;
+	}
+	p->inlen = in.size;
+	p->inpos = in.pos;
+	p->outlen = out.pos;
+}
+
+// Compress the image to a zstd file
+static int zst_write (DskImage *img, FILE *file, uint8_t *data, uint32_t size) {
+	ZSTD_CCtx     *cctx = ZSTD_createCCtx();
+	uint8_t       *buf = (uint8_t *) malloc(PACK_IOBUF);
+	ZSTD_inBuffer  in = { data, size, 0 };
+	ZSTD_outBuffer out;
+	size_t         left;
+	int            ret = DSK_OK;
+
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, img->packlevel);
+	ZSTD_CCtx_setPledgedSrcSize(cctx, size);
+	do {
+		out.dst = buf;
+		out.size = PACK_IOBUF;
+		out.pos = 0;
+		left = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_end);
+		if (ZSTD_isError(left) || (out.pos && fwrite(buf, 1, out.pos, file) != out.pos)) {
+			ret = DSK_ERR_IMAGE;
+			break;
+		}
+	} while (left);
+	ZSTD_freeCCtx(cctx);
+	free(buf);
+	return ret;
+}
+#endif
+
+// Read the sectors of an overlay image and open its base image
+static int ovl_open (DskImage *img, FILE *file) {
+	struct pack_s *p;
+	ovlheader_t head;
+	FILE *base;
+
+	if (fread(&head, sizeof(head), 1, file) != 1) return 0;
+	p = img->pack = (struct pack_s *) calloc(1, sizeof(struct pack_s));
+	p->type = PACK_OVERLAY;
+	p->size = head.size;
+	p->ovlnum = head.sectors;
+	p->ovlbps = head.bytesPerSector;
+	p->ovlsec = (uint32_t *) malloc(head.sectors*sizeof(uint32_t)+1);
+	p->ovldata = (uint8_t *) malloc((size_t)head.sectors*head.bytesPerSector+1);
+	if (head.namelen >= sizeof(p->name) || !head.bytesPerSector || fread(p->name, 1, head.namelen, file) != head.namelen ||
+	    fread(p->ovlsec, sizeof(uint32_t), head.sectors, file) != head.sectors ||
+	    fread(p->ovldata, head.bytesPerSector, head.sectors, file) != head.sectors) {
+		fprintf(img->out, "ERROR bad overlay image\n");
+		p->error = p->done = 1;
+	} else if ((base = fopen(p->name, "rb")) == NULL) {
+		fprintf(img->out, "ERROR base image %s not found\n", p->name);
+		p->error = p->done = 1;
+	} else {
+		p->file = base;
+	}
+	fclose(file);
+	return 1;
+}
+
+// Read the base image of an overlay up to the specified offset, with the overlay sectors over it
+static void ovl_decode (DskImage *img, uint32_t upto) {
+	struct pack_s *p = img->pack;
+	uint32_t from = p->outlen, start, end, k;
+
+	if (fread(img->dskimage+from, 1, upto-from, p->file) != upto-from) {
+		p->error = 1;
+		return;
+	}
+	for (k=0; k<p->ovlnum; k++) {
+		start = p->ovlsec[k]*p->ovlbps;
+		end = start+p->ovlbps;
+		if (start < from) start = from;
+		if (end > upto) end = upto;
+		if (start < end)
+			memcpy(img->dskimage+start, p->ovldata+k*p->ovlbps+start-p->ovlsec[k]*p->ovlbps, end-start);
+	}
+	p->outlen = upto;
+}
+
+// Container of an image from the signature at its start (0 for a plain image)
+static uint8_t pack_magic (uint8_t *head, size_t n) {
+	if (n>=8 && !memcmp(head, OVL_MAGIC, 8)) return PACK_OVERLAY;
+	if (n>=4 && !memcmp(head, "PCK\x08", 4)) return PACK_XSA;
+	if (n>=2 && head[0]==0x1F && head[1]==0x8B) return PACK_GZIP;
+	if (n>=4 && !memcmp(head, "\x28\xB5\x2F\xFD", 4)) return PACK_ZSTD;
+	return 0;
+}
+
+// Check the signature of a compressed image and prepare its decoder, the image is decoded later on demand
+// (-1: a container this build can't read)
+static int pack_open (DskImage *img, FILE *file) {
+	uint8_t head[8];
+	size_t  n;
+
+	n = fread(head, 1, 8, file);
+	rewind(file);
+	switch (pack_magic(head, n)) {
+		case PACK_OVERLAY: return ovl_open(img, file);
+		case PACK_XSA:     return xsa_open(img, file);
+#ifdef HAVE_ZLIB
+		case PACK_GZIP:    return gz_open(img, file);
+#else
+		case PACK_GZIP:    fprintf(img->out, "ERROR gzip support not compiled in\n"); return -1;
+#endif
+#ifdef HAVE_ZSTD
+		case PACK_ZSTD:    return zst_open(img, file);
+#else
+		case PACK_ZSTD:    fprintf(img->out, "ERROR zstd support not compiled in\n"); return -1;
+#endif
+	}
+	return 0;
+}
+
+// Release the input and the decoder of a compressed image
+static void pack_close (struct pack_s *p) {
+	if (p->file != NULL) fclose(p->file);
+	p->file = NULL;
+#ifdef HAVE_ZLIB
+	if (p->type == PACK_GZIP) inflateEnd(&p->gz);
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_freeDStream(p->zd);
+	p->zd = NULL;
+#endif
+}
+
+static void pack_free (DskImage *img) {
+	if (img->pack == NULL) return;
+	pack_close(img->pack);
+	free(img->pack->ovlsec);
+	free(img->pack->ovldata);
+	free(img->pack);
+}
+
+// Decode a compressed image up to the specified offset (or to the end)
+static void pack_decode (DskImage *img, uint32_t upto) {
+	struct pack_s *p = img->pack;
+	static const char *ext[] = { "", ".XSA", ".GZ", ".ZST", "base" };
+
+	if (upto > p->size) upto = p->size;
+	if (p->done || p->outlen >= upto) return;
+	switch (p->type) {
+		case PACK_XSA:  xsa_decode(img, upto); break;
+		case PACK_OVERLAY: ovl_decode(img, upto); break;
+#ifdef HAVE_ZLIB
+		case PACK_GZIP: gz_decode(img, upto); break;
+#endif
+#ifdef HAVE_ZSTD
+		case PACK_ZSTD: zst_decode(img, upto); break;
+#endif
+	}
+	if (p->error && !p->done) {
+		fprintf(img->out, "ERROR bad %s image\n", ext[p->type]);
+		p->done = 1;
+	}
+	//The input isn't needed anymore once the whole image is decoded
+	if (p->done || p->outlen == p->size) {
+		p->done = 1;
+		pack_close(p);
+	}
+}
+
+// Output of the XSA encoder: flag bytes are reserved in the stream when their first bit is written
+typedef struct {
+	FILE    *file;
+	uint8_t  buf[PACK_IOBUF];
+	uint32_t len;
+	uint32_t flagpos;					// Position of the flag byte being filled
+	uint8_t  bitcnt;					// Bits used in it (8: none reserved)
+	uint64_t total;
+	int      error;
+	xsahuf_t huf;
+} xsaenc_t;
+
+// Write the completed part of the output buffer
+static void xsa_flushbuf (xsaenc_t *e, uint32_t upto) {
+	if (upto && fwrite(e->buf, 1, upto, e->file) != upto) e->error = 1;
+	memmove(e->buf, e->buf+upto, e->len-upto);
+	e->len -= upto;
+	e->flagpos -= upto;
+	e->total += upto;
+}
+
+static void xsa_out (xsaenc_t *e, uint8_t c) {
+	if (e->len == PACK_IOBUF) xsa_flushbuf(e, e->bitcnt<8 ? e->flagpos : e->len);
+	e->buf[e->len++] = c;
+}
+
+static void xsa_putbit (xsaenc_t *e, uint8_t bit) {
+	if (e->bitcnt == 8) {
+		xsa_out(e, 0);
+		e->flagpos = e->len-1;
+		e->bitcnt = 0;
+	}
+	e->buf[e->flagpos] |= bit << e->bitcnt++;
+}
+
+// Bits of a value, most significant first
+static void xsa_putbits (xsaenc_t *e, uint32_t value, uint8_t n) {
+	while (n--) {
+		xsa_putbit(e, (value>>n) & 1);
+	}
+}
+
+static void xsa_putstrlen (xsaenc_t *e, uint32_t len) {
+	uint8_t nbits;
+
+	if (len <= 4) {
+		xsa_putbits(e, (1<<(len-1))-2, len-1);
+		return;
+	}
+	xsa_putbits(e, 7, 3);
+	for (nbits=2; (len-1)>>(nbits+1); nbits++) {
+		xsa_putbit(e, 1);
+	}
+	if (nbits != 7) xsa_putbit(e, 0);
+	xsa_putbits(e, len-1, nbits);
+}
+
+static void xsa_putstrpos (xsaenc_t *e, uint32_t dist) {
+	xsahuf_t *h = &e->huf;
+	uint8_t   code, i;
+
+	for (code=XSA_TBLSIZE-3; h->cpdist[code] > dist; code--);
+	for (i=0; i<h->codelen[code]; i++) {
+		xsa_putbit(e, (h->code[code]>>i) & 1);
+	}
+	h->tblsizes[code]++;
+
+	dist -= h->cpdist[code];
+	if (xsa_cpdext[code] >= 8) {
+		xsa_out(e, dist & 0xFF);
+		xsa_putbits(e, dist>>8, xsa_cpdext[code]-8);
+	} else {
+		xsa_putbits(e, dist, xsa_cpdext[code]);
+	}
+	if (h->updhufcnt-- == 0)
+		xsa_mkhuftbl(h);
+}
+
+// Bits saved by a string instead of its literals (about 4 bits for the Huffman coded distance)
+static int32_t xsa_gain (uint32_t len, uint32_t dist) {
+	int32_t bits = 1+4, nbits;
+
+	for (nbits=0; dist>1 && (dist-1)>>(nbits+1); nbits++);
+	bits += dist>1 ? nbits : 0;
+	if (len <= 4) return len*9 - bits - (len-1);
+	for (nbits=2; (len-1)>>(nbits+1); nbits++);
+	return len*9 - bits - 3 - (nbits-2) - (nbits!=7) - nbits;
+}
+
+// Most profitable string at a position, searching the hash chain up to the given depth
+static uint32_t xsa_match (uint8_t *data, uint32_t pos, uint32_t size, int32_t *head, int32_t *prev, uint32_t depth, uint32_t *dist) {
+	uint32_t best = 0, max = size-pos, len;
+	int32_t  cand, gain, bestgain = 0;
+
+	if (max > XSA_MAXSTRLEN) max = XSA_MAXSTRLEN;
+	if (max < 3) return 0;
+	//Candidates come nearest first: a farther one has to be longer to pay its longer distance
+	for (cand = head[(data[pos] | data[pos+1]<<8 | data[pos+2]<<16) * 2654435761u >> 18];
+		 cand >= 0 && pos-cand <= XSA_WINDOW && depth--; cand = prev[cand % XSA_WINDOW]) {
+		if (data[cand+best] != data[pos+best]) continue;
+		for (len=0; len<max && data[cand+len]==data[pos+len]; len++);
+		if (len > best && (gain = xsa_gain(len, pos-cand)) > bestgain) {
+			best = len;
+			bestgain = gain;
+			*dist = pos-cand;
+			if (len == max) break;
+		}
+	}
+	return best>=3 ? best : 0;
+}
+
+// Insert a position in the hash chains
+static void xsa_insert (uint8_t *data, uint32_t pos, uint32_t size, int32_t *head, int32_t *prev) {
+	uint32_t h;
+
+	if (pos+3 > size) return;
+	h = (data[pos] | data[pos+1]<<8 | data[pos+2]<<16) * 2654435761u >> 18;
+	prev[pos % XSA_WINDOW] = head[h];
+	head[h] = pos;
+}
+
+// Compress an image to a XSA file. Level 1 (fastest) to 9 (smallest) sets the match finder effort
+static int xsa_write (DskImage *img, FILE *file, uint8_t *data, uint32_t size, char *name) {
+	xsaenc_t *e = (xsaenc_t *) calloc(1, sizeof(xsaenc_t));
+	int32_t  *head = (int32_t *) malloc((1<<14) * sizeof(int32_t));
+	int32_t  *prev = (int32_t *) malloc(XSA_WINDOW * sizeof(int32_t));
+	uint8_t   level = img->packlevel<1 ? 1 : img->packlevel>9 ? 9 : img->packlevel;
+	uint32_t  depth = 2<<level, pos = 0, len, dist, i;
+	uint8_t   hdr[4];
+	int       ret;
+
+	memset(head, 0xFF, (1<<14) * sizeof(int32_t));
+	e->file = file;
+	e->bitcnt = 8;
+	xsa_inithuf(&e->huf);
+
+	fwrite("PCK\x08", 1, 4, file);
+	memcpy(hdr, &size, 4);
+	fwrite(hdr, 1, 4, file);
+	fwrite("\0\0\0\0", 1, 4, file);
+	fwrite(name, 1, strlen(name)+1, file);
+
+	while (pos < size) {
+		len = xsa_match(data, pos, size, head, prev, depth, &dist);
+		if (!len) {
+			xsa_insert(data, pos, size, head, prev);
+			xsa_putbit(e, 0);
+			xsa_out(e, data[pos++]);
+			continue;
+		}
+		xsa_putbit(e, 1);
+		xsa_putstrlen(e, len);
+		xsa_putstrpos(e, dist);
+		for (i=0; i<len; i++) {
+			xsa_insert(data, pos+i, size, head, prev);
+		}
+		pos += len;
+	}
+	xsa_putbit(e, 1);
+	xsa_putstrlen(e, XSA_MAXSTRLEN+1);
+	xsa_flushbuf(e, e->len);
+
+	//Compressed size in the header
+	memcpy(hdr, &e->total, 4);
+	if (fseek(file, 8, SEEK_SET) || fwrite(hdr, 1, 4, file) != 4) e->error = 1;
+	ret = e->error ? DSK_ERR_IMAGE : DSK_OK;
+	free(head);
+	free(prev);
+	free(e);
+	return ret;
+}
+
+// Map the DSK file in memory: the pages written stay private until flush_dsk writes them back
+static int map_dsk (DskImage *img, FILE *file, uint64_t sizetoread, uint8_t mode) {
+#ifdef WIN32
+	return DSK_OK;
+#else
+	struct stat attr;
+	uint64_t    mapsize, delta;
+	void       *map;
+
+	if (fstat(fileno(file), &attr) || (uint64_t)attr.st_size < img->partoffset+sizetoread) {
+		fprintf(img->out, "ERROR bad .DSK image\n");
+		return DSK_ERR_IMAGE;
+	}
+	//A file shorter than its volume is read into zeroed memory instead, so no access falls past the mapping
+	if ((uint64_t)attr.st_size-img->partoffset < img->disksize) return DSK_OK;
+	//Only the pages touched are read: a partition is mapped from its first page
+	mapsize = img->disksize;
+	delta = img->partoffset & (sysconf(_SC_PAGESIZE)-1);
+	if (mode & READ_WRITE)
+		map = mmap(NULL, mapsize+delta, PROT_READ|PROT_WRITE, MAP_PRIVATE, fileno(file), img->partoffset-delta);
+	else
+		map = mmap(NULL, mapsize+delta, PROT_READ, MAP_PRIVATE, fileno(file), img->partoffset-delta);
+	if (map == MAP_FAILED) return DSK_OK;
+
+	img->mapbase = (uint8_t *)map;
+	img->maplen = mapsize+delta;
+	img->dskimage = img->mapbase+delta;
+	img->dskmapped = 1;
+	return DSK_OK;
+#endif
+}
+
+// Reserve the memory of a big image, leaving its data area to be read on demand
+static int cache_open (DskImage *img, uint32_t clusteroffset) {
+#ifdef WIN32
+	return 0;
+#else
+	uint32_t pagesize = sysconf(_SC_PAGESIZE);
+	uint32_t delta = (pagesize - clusteroffset%pagesize) % pagesize;
+	uint32_t blocks = (img->disksize-clusteroffset+CACHE_BLOCK-1) / CACHE_BLOCK;
+	void    *map;
+
+	//Untouched pages take no memory, and the data area starts at a page boundary
+	//so the evicted blocks can be given back
+	map = mmap(NULL, img->disksize+delta, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED) return 0;
+	img->mapbase = (uint8_t *)map;
+	img->maplen = img->disksize+delta;
+	img->dskimage = img->mapbase+delta;
+	img->cacheres = (uint8_t *) calloc((blocks+7)/8, 1);
+	img->cacheprev = (uint32_t *) calloc(blocks, sizeof(uint32_t));
+	img->cachenext = (uint32_t *) calloc(blocks, sizeof(uint32_t));
+	img->dskcached = 1;
+	return 1;
+#endif
+}
+
+// Split an "IMAGE:N" partition suffix from the image name
+static char *split_partition (DskImage *img, char *name, char *path) {
+	char  *colon = strrchr(name, ':');
+	size_t len;
+	int    num;
+
+	//A colon at the second position is a drive letter
+	if (colon==NULL || colon-name<2 || !colon[1] || strspn(colon+1, "0123456789")!=strlen(colon+1)) return name;
+	num = atoi(colon+1);
+	len = colon-name;
+	if (num<1 || num>MAX_PARTITIONS || len>=1024) return name;
+	memcpy(path, name, len);
+	path[len] = 0;
+	img->partition = num;
+	return path;
+}
+
+// Check that a boot sector holds a usable BIOS parameter block
+static int valid_bpb (bootsec_t *bootsec) {
+	uint8_t spc = bootsec->sectorsPerCluster;
+
+	return bootsec->bytesPerSector==512 && spc && !(spc&(spc-1)) && bootsec->reservedSectors &&
+		bootsec->numberOfFATs>=1 && bootsec->numberOfFATs<=2 && bootsec->sectorsPerFAT;
+}
+
+// Read one 512 bytes sector of the image file
+static int read_sector (FILE *file, uint64_t sector, uint8_t *buf) {
+	return !FSEEK64(file, sector*512) && fread(buf, 512, 1, file)==1;
+}
+
+// Store a partition table entry, with its start relative to the specified sector
+static void add_partition (DskImage *img, uint8_t *entry, uint32_t base) {
+	partition_t *part;
+	uint32_t     start, sectors;
+
+	memcpy(&start, entry+8, 4);
+	memcpy(&sectors, entry+12, 4);
+	if (!entry[4] || !sectors || img->numparts>=MAX_PARTITIONS) return;
+	part = &img->parts[img->numparts++];
+	part->type = entry[4];
+	part->start = base+start;
+	part->sectors = sectors;
+}
+
+// Collect the partitions of a MBR partition table, following the extended partitions chain
+static void read_partitions (DskImage *img, FILE *file, uint8_t *mbr) {
+	uint8_t  sec[512], *entry;
+	uint32_t extstart = 0, ebr, hops, i;
+
+	for (i=0; i<4; i++) {
+		entry = mbr+0x1BE + i*16;
+		if (entry[4]==0x05 || entry[4]==0x0F) {
+			if (!extstart) memcpy(&extstart, entry+8, 4);
+			continue;
+		}
+		add_partition(img, entry, 0);
+	}
+	//Each extended boot record holds a logical partition and the link to the next record
+	for (ebr=extstart, hops=0; ebr && hops<256 && img->numparts<MAX_PARTITIONS; hops++) {
+		if (!read_sector(file, ebr, sec) || sec[510]!=0x55 || sec[511]!=0xAA) break;
+		add_partition(img, sec+0x1BE, ebr);
+		entry = sec+0x1BE + 16;
+		if (entry[4]!=0x05 && entry[4]!=0x0F) break;
+		memcpy(&ebr, entry+8, 4);
+		ebr += extstart;
+	}
+}
+
+// Locate the selected partition of a hard-disk image and read its boot sector
+static int select_partition (DskImage *img, FILE *file) {
+	uint8_t *sec = (uint8_t *)img->bootsec;
+	uint32_t i;
+
+	if (valid_bpb(img->bootsec) || sec[510]!=0x55 || sec[511]!=0xAA) {
+		if (!img->partition) return DSK_OK;
+		fprintf(img->out, "ERROR the image has no partition table\n");
+		return DSK_ERR_IMAGE;
+	}
+	for (i=0; i<4 && !sec[0x1BE + i*16+4]; i++);
+	if (i==4) return DSK_OK;
+
+	read_partitions(img, file, sec);
+	if (!img->partition) img->partition = 1;
+	if (img->partition > img->numparts) {
+		fprintf(img->out, "ERROR partition %u not found\n", img->partition);
+		return DSK_ERR_IMAGE;
+	}
+	img->partoffset = (uint64_t)img->parts[img->partition-1].start*512;
+	if (!read_sector(file, img->parts[img->partition-1].start, sec) || !valid_bpb(img->bootsec)) {
+		fprintf(img->out, "ERROR partition %u is not a FAT volume\n", img->partition);
+		return DSK_ERR_IMAGE;
+	}
+	return DSK_OK;
+}
+
+// Release what a failed load_dsk took
+static void load_fail (DskImage *img, FILE *file) {
+	free(img->bootsec);
+	img->bootsec = NULL;
+	if (img->pack != NULL)
+		pack_close(img->pack);
+	else if (file != NULL)
+		fclose(file);
+}
+
+// Load the specified DSK file into memory
+int load_dsk (DskImage *img, char *name, uint8_t mode, uint8_t error) {
+	FILE *file;
+	bootsec_t *bootsec;
+	uint64_t sizetoread;
+	char path[1024], desc[300];
+	int ret;
+
+	if (name) name = split_partition(img, name, path);
+	file = name ? fopen(name, (mode & READ_WRITE) ? "r+b" : "rb") : NULL;
+
+	//Boot sector (of the selected partition for a hard-disk image)
+	if (file==NULL) {
+		if (error==ERROR || img->partition) {
+			fprintf (img->out, "ERROR in .DSK file\n");
+			return DSK_ERR_IMAGE;
+		}
+		if ((ret=create_boot(img))) return ret;
+	} else {
+		img->bootsec = (bootsec_t *)malloc(512);
+		if ((ret = pack_open(img, file)) < 0) {
+			ret = DSK_ERR_FORMAT;
+		} else if (ret) {
+			//Compressed image: the boot sector is decoded first
+			img->dskimage = (uint8_t *) calloc(img->pack->size, 1);
+			pack_decode(img, 512);
+			if (img->pack->outlen < 512) {
+				if (!img->pack->error) fprintf(img->out, "ERROR bad compressed .DSK image\n");
+				ret = DSK_ERR_IMAGE;
+			} else {
+				memcpy(img->bootsec, img->dskimage, 512);
+				ret = DSK_OK;
+			}
+		} else if (!fread(img->bootsec, 512, 1, file)) {
+			fprintf(img->out, "ERROR bad .DSK image\n");
+			ret = DSK_ERR_IMAGE;
+		} else {
+			ret = select_partition(img, file);
+		}
+		if (ret) {
+			load_fail(img, file);
+			return ret;
+		}
+		if (img->pack == NULL) FSEEK64(file, img->partoffset);
+	}
+	bootsec = img->bootsec;
+	img->totalsectors = bootsec->totalSectors;
+	if (!img->totalsectors) memcpy(&img->totalsectors, (uint8_t *)bootsec+0x20, 4);
+	if ((uint64_t)bootsec->bytesPerSector * img->totalsectors > 0xFFFFFFFF) {
+		fprintf(img->out, "ERROR volumes over 4Gb are not supported\n");
+		load_fail(img, file);
+		return DSK_ERR_FORMAT;
+	}
+	img->disksize = bootsec->bytesPerSector * img->totalsectors;
+	img->bytespercluster = bootsec->bytesPerSector*bootsec->sectorsPerCluster;
+
+	uint32_t fatoffset = bootsec->bytesPerSector * bootsec->reservedSectors;
+	uint32_t rootoffset = fatoffset + bootsec->bytesPerSector * (bootsec->sectorsPerFAT * bootsec->numberOfFATs);
+	uint32_t clusteroffset = rootoffset + bootsec->maxDirectoryEntries * sizeof(direntry_t);
+	sizetoread = (mode & READ_BOOTFAT) ? clusteroffset : img->disksize;
+
+	img->dirtymap = (uint8_t *) calloc((img->totalsectors+7)/8, 1);
+
+	//Images bigger than a floppy are read on demand, others mapped whole or allocated
+	if (img->pack != NULL) {
+		if (img->pack->size < img->disksize) {
+			img->dskimage = (uint8_t *) realloc(img->dskimage, img->disksize);
+			memset(img->dskimage+img->pack->size, 0, img->disksize-img->pack->size);
+		}
+	} else if (file!=NULL && !img->isADVH && img->disksize>CACHE_MIN_SIZE && clusteroffset<img->disksize && cache_open(img, clusteroffset)) {
+		sizetoread = clusteroffset;
+	} else if (file!=NULL && (ret=map_dsk(img, file, sizetoread, mode))) {
+		load_fail(img, file);
+		return ret;
+	}
+	if (!img->dskmapped && !img->dskcached && img->pack==NULL) {
+		img->dskimage = (uint8_t *) calloc(img->disksize, 1);
+	}
+
+	img->fat = img->dskimage + fatoffset;
+	img->rootdir = (direntry_t*) (img->dskimage + rootoffset);
+	img->cluster = img->dskimage + clusteroffset;
+	img->availsectors = img->totalsectors - bootsec->reservedSectors - bootsec->sectorsPerFAT * bootsec->numberOfFATs;
+	img->availsectors -= bootsec->maxDirectoryEntries * sizeof(direntry_t) / bootsec->bytesPerSector;
+	img->fatelements = img->availsectors / bootsec->sectorsPerCluster;
+
+	//The FAT type is given by the number of clusters
+	if (img->fatelements > 65524) {
+		fprintf(img->out, "ERROR FAT32 volumes are not supported\n");
+		load_fail(img, file);
+		return DSK_ERR_FORMAT;
+	}
+	img->fat16 = img->fatelements >= 4085;
+	img->fateoc = img->fat16 ? 0xFFFF : 0xFFF;
+	img->fatbad = img->fat16 ? 0xFFF7 : 0xFF7;
+
+	if (file==NULL) {
+		img->dsknew = 1;
+		memcpy(img->dskimage, bootsec, 512);
+		img->fat[0]=bootsec->mediaDescriptor;
+		img->fat[1]=0xFF;
+		img->fat[2]=0xFF;
+	} else if (img->pack != NULL) {
+		//Only the system area is decoded now, the data when it's used (all of it to write the image back)
+		pack_decode(img, (mode & READ_WRITE) || img->isADVH ? img->pack->size : clusteroffset);
+		if (img->pack->error) {
+			load_fail(img, file);
+			return DSK_ERR_IMAGE;
+		}
+		img->rootADVH = (advhDirentry_t*) (img->dskimage + 512);
+	} else {
+		//Not mapped: everything the file holds, the system area at least
+		if (!img->dskmapped && fread(img->dskimage, 1, img->disksize, file) < sizetoread) {
+			fprintf(img->out, "ERROR bad .DSK image\n");
+			load_fail(img, file);
+			return DSK_ERR_IMAGE;
+		}
+#ifndef WIN32
+		img->dskfd = dup(fileno(file));
+#endif
+		fclose (file);
+
+		img->rootADVH = (advhDirentry_t*) (img->dskimage + 512);
+	}
+	free (bootsec);
+	img->bootsec = (bootsec_t*) img->dskimage;
+	if (!img->isADVH) {
+		unpack_fat(img);
+		build_freemap(img);
+		img->freedmap = (uint8_t *) calloc((2+img->fatelements+7)/8, 1);
+	}
+
+	if (img->partition)
+		fprintf(img->out, "Partition %u of %u\n", img->partition, img->numparts);
+	//The container of the image goes after its format
+	if (img->pack == NULL)
+		*desc = 0;
+	else if (img->pack->type == PACK_OVERLAY)
+		snprintf(desc, sizeof(desc), " (overlay of %s)", img->pack->name);
+	else
+		sprintf(desc, " (%s compressed)", img->pack->type==PACK_XSA ? "XSA" : img->pack->type==PACK_GZIP ? "gzip" : "zstd");
+	fprintf(img->out, "Disk image size:  %uKb\n%s%s\n\n", img->disksize/1024, img->isADVH?"ADVH Format":img->fat16?"FAT16 format":"Standard format", desc);
+	return DSK_OK;
+}
+
+// Mark the sectors of a modified range of the disk image
+static void mark_dirty (DskImage *img, void *ptr, uint32_t len) {
+	uint32_t first, last;
+
+	if (!len) return;
+	first = ((uint8_t *)ptr-img->dskimage) / img->bootsec->bytesPerSector;
+	last = ((uint8_t *)ptr-img->dskimage+len-1) / img->bootsec->bytesPerSector;
+	for (; first<=last; first++) {
+		img->dirtymap[first>>3] |= 1<<(first&7);
+	}
+}
+
+// Check if a sector was modified
+static uint8_t is_dirty (DskImage *img, uint32_t sector) {
+	return img->dirtymap[sector>>3] & (1<<(sector&7));
+}
+
+// Check if a data area block is in the sector cache
+static uint8_t is_resident (DskImage *img, uint32_t block) {
+	return img->cacheres[block>>3] & (1<<(block&7));
+}
+
+// Bytes of the data area held by a block (the last one may be shorter)
+static uint32_t block_size (DskImage *img, uint32_t block) {
+	uint64_t left = img->disksize - (img->cluster-img->dskimage) - (uint64_t)block*CACHE_BLOCK;
+
+	return left<CACHE_BLOCK ? left : CACHE_BLOCK;
+}
+
+// Put a block at the head of the LRU list
+static void cache_link (DskImage *img, uint32_t block) {
+	img->cacheprev[block] = 0;
+	img->cachenext[block] = img->cachehead;
+	if (img->cachehead)
+		img->cacheprev[img->cachehead-1] = block+1;
+	else
+		img->cachetail = block+1;
+	img->cachehead = block+1;
+}
+
+// Take a block out of the LRU list
+static void cache_unlink (DskImage *img, uint32_t block) {
+	uint32_t prev = img->cacheprev[block], next = img->cachenext[block];
+
+	if (prev) img->cachenext[prev-1] = next; else img->cachehead = next;
+	if (next) img->cacheprev[next-1] = prev; else img->cachetail = prev;
+}
+
+// Write back the modified sectors of a block and release its memory
+static int cache_evict (DskImage *img, uint32_t block) {
+#ifndef WIN32
+	uint32_t bps = img->bootsec->bytesPerSector;
+	uint8_t *ptr = img->cluster + (uint64_t)block*CACHE_BLOCK;
+	uint32_t size = block_size(img, block);
+	uint32_t first = (ptr-img->dskimage) / bps, end = first+size/bps, last, i;
+
+	for (; first<end; first=last) {
+		if (!is_dirty(img, first)) {
+			last = first+1;
+			continue;
+		}
+		for (last=first+1; last<end && is_dirty(img, last); last++);
+		if (pwrite(img->dskfd, img->dskimage+first*bps, (last-first)*bps, img->partoffset+(uint64_t)first*bps) < 0) {
+			fprintf(img->out, "ERROR writing .DSK image\n");
+			return DSK_ERR_IMAGE;
+		}
+		for (i=first; i<last; i++) {
+			img->dirtymap[i>>3] &= ~(1<<(i&7));
+		}
+	}
+	madvise(ptr, size, MADV_DONTNEED);
+	cache_unlink(img, block);
+	img->cacheres[block>>3] &= ~(1<<(block&7));
+	img->cacheused -= size;
+#endif
+	return DSK_OK;
+}
+
+// Make a range of the data area resident, reading the missing blocks from the image file
+static void cache_load (DskImage *img, void *ptr, uint32_t len) {
+	//A compressed image is decoded up to the end of the range
+	if (img->pack != NULL) {
+		pack_decode(img, (uint8_t *)ptr+len-img->dskimage);
+		return;
+	}
+#ifndef WIN32
+	uint8_t *dst;
+	uint64_t start, end, size;
+	uint32_t b, e, last;
+	ssize_t  done;
+
+	if (!img->dskcached || !len || (uint8_t *)ptr+len <= img->cluster) return;
+	start = (uint8_t *)ptr > img->cluster ? (uint8_t *)ptr-img->cluster : 0;
+	end = (uint8_t *)ptr+len-img->cluster;
+	last = (end-1) / CACHE_BLOCK;
+	for (b=start/CACHE_BLOCK; b<=last; b=e) {
+		if (is_resident(img, b)) {
+			cache_unlink(img, b);
+			cache_link(img, b);
+			e = b+1;
+			continue;
+		}
+		//Consecutive missing blocks are read at once
+		for (e=b+1; e<=last && !is_resident(img, e); e++);
+		dst = img->cluster + (uint64_t)b*CACHE_BLOCK;
+		size = (uint64_t)(e-1-b)*CACHE_BLOCK + block_size(img, e-1);
+		while (size && (done=pread(img->dskfd, dst, size, img->partoffset+(dst-img->dskimage))) > 0) {
+			dst += done;
+			size -= done;
+		}
+		for (; b<e; b++) {
+			img->cacheres[b>>3] |= 1<<(b&7);
+			cache_link(img, b);
+			img->cacheused += block_size(img, b);
+		}
+	}
+#endif
+}
+
+// Evict the least recently used blocks until the cache fits in its budget
+static void cache_trim (DskImage *img) {
+	while (img->dskcached && img->cacheused > img->cachebudget && img->cachetail) {
+		if (cache_evict(img, img->cachetail-1)) break;
+	}
+}
+
+// Evict the resident blocks of a range that is going to be written straight to the image file
+static void cache_drop (DskImage *img, void *ptr, uint32_t len) {
+	uint32_t b, last;
+
+	if (!img->dskcached || !len) return;
+	last = ((uint8_t *)ptr+len-1-img->cluster) / CACHE_BLOCK;
+	for (b=((uint8_t *)ptr-img->cluster)/CACHE_BLOCK; b<=last; b++) {
+		if (is_resident(img, b)) cache_evict(img, b);
+	}
+}
+
+// Decode the packed FAT12 (or the FAT16) table into the FAT cache
+static void unpack_fat (DskImage *img) {
+	uint32_t fatbytes = img->bootsec->sectorsPerFAT * img->bootsec->bytesPerSector;
+	uint8_t *fat = img->fat;
+	uint16_t *fatcache;
+	uint32_t i, g;
+	uint64_t w;
+	uint8_t *p;
+
+	//FAT16 entries are little-endian words, as the FAT12 groups below
+	if (img->fat16) {
+		img->fatentries = fatbytes/2;
+		img->fatcache = (uint16_t *) malloc(fatbytes);
+		memcpy(img->fatcache, fat, fatbytes);
+		return;
+	}
+	img->fatentries = fatbytes/3*2;
+	fatcache = img->fatcache = (uint16_t *) malloc((img->fatentries+4) * sizeof(uint16_t));
+
+	//Each 6 bytes group holds 4 little-endian packed 12 bits entries
+	p = fat;
+	for (i=0; i+4<=img->fatentries && (uint32_t)(p-fat)+8<=fatbytes; i+=4, p+=6) {
+		memcpy(&w, p, 8);
+		fatcache[i]   = w & 0xFFF;
+		fatcache[i+1] = (w>>12) & 0xFFF;
+		fatcache[i+2] = (w>>24) & 0xFFF;
+		fatcache[i+3] = (w>>36) & 0xFFF;
+	}
+	for (g=i/2*3; i<img->fatentries; i+=2, g+=3) {
+		fatcache[i]   = fat[g] | ((fat[g+1]&0xF)<<8);
+		fatcache[i+1] = (fat[g+1]>>4) | (fat[g+2]<<4);
+	}
+}
+
+// Encode the FAT cache back into the packed FAT12 (or the FAT16) table
+static void pack_fat (DskImage *img) {
+	uint16_t *fatcache = img->fatcache;
+	uint32_t bps = img->bootsec->bytesPerSector;
+	uint32_t i;
+	uint64_t w;
+	uint8_t *p;
+	uint8_t  b[3];
+
+	//Only the changed bytes are written and marked as dirty
+	if (img->fat16) {
+		p = (uint8_t *)fatcache;
+		for (i=0; i<img->fatentries*2; i+=bps) {
+			if (memcmp(img->fat+i, p+i, bps)) {
+				memcpy(img->fat+i, p+i, bps);
+				mark_dirty(img, img->fat+i, bps);
+			}
+		}
+		return;
+	}
+	p = img->fat;
+	for (i=0; i+4<=img->fatentries; i+=4, p+=6) {
+		w = (uint64_t)(fatcache[i]&0xFFF) |
+			((uint64_t)(fatcache[i+1]&0xFFF)<<12) |
+			((uint64_t)(fatcache[i+2]&0xFFF)<<24) |
+			((uint64_t)(fatcache[i+3]&0xFFF)<<36);
+		if (memcmp(p, &w, 6)) {
+			memcpy(p, &w, 6);
+			mark_dirty(img, p, 6);
+		}
+	}
+	for (; i<img->fatentries; i+=2, p+=3) {
+		b[0] = fatcache[i] & 0xFF;
+		b[1] = ((fatcache[i]>>8)&0xF) | ((fatcache[i+1]&0xF)<<4);
+		b[2] = fatcache[i+1]>>4;
+		if (memcmp(p, b, 3)) {
+			memcpy(p, b, 3);
+			mark_dirty(img, p, 3);
+		}
+	}
+}
+
+// Go to the next rootdirectory entry
+int next_link (DskImage *img, uint16_t link) {
+	if (link>=img->fatentries) return img->fateoc;
+	return img->fatcache[link];
+}
+
+// Mark a cluster as free or in use in the free clusters bitmap
+static void set_freemap (DskImage *img, uint16_t link, uint8_t isfree) {
+	uint8_t bit = 1<<(link&7);
+
+	if (link<2 || link>=2+img->fatelements) return;
+	if (isfree) {
+		if (img->freemap[link>>3] & bit) return;
+		img->freemap[link>>3] |= bit;
+		if (img->freedmap) img->freedmap[link>>3] |= bit;
+		img->freeclusters++;
+		if (link<img->nextfree) img->nextfree = link;
+	} else {
+		if (!(img->freemap[link>>3] & bit)) return;
+		img->freemap[link>>3] &= ~bit;
+		img->freeclusters--;
+	}
+}
+
+// Build the free clusters bitmap from the FAT
+static void build_freemap (DskImage *img) {
+	uint32_t i, last;
+
+	//Clusters not covered by the FAT sectors are never available
+	last = 2+img->fatelements;
+	if (last > img->fatentries)
+		last = img->fatentries;
+
+	img->freemap = (uint8_t *) malloc((2+img->fatelements+7)/8);
+	memset(img->freemap, 0, (2+img->fatelements+7)/8);
+	img->freeclusters = 0;
+	img->nextfree = 2+img->fatelements;
+	for (i=2; i<last; i++) {
+		if (!next_link(img, i)) set_freemap(img, i, 1);
+	}
+}
+
+// Find the first free cluster starting at the specified one
+static uint32_t find_free (DskImage *img, uint32_t from) {
+	uint32_t i = from;
+
+	while (i<2+img->fatelements) {
+		//Skip full bytes of clusters in use
+		if (!(i&7) && !img->freemap[i>>3]) {
+			i+=8;
+			continue;
+		}
+		if (img->freemap[i>>3] & (1<<(i&7))) return i;
+		i++;
+	}
+	return 0;
+}
+
+// Remove a directory entry
+int remove_link (DskImage *img, uint16_t link) {
+	uint16_t current;
+
+	if (link>=img->fatentries) return img->fateoc;
+	current = img->fatcache[link];
+	img->fatcache[link] = 0;
+	set_freemap(img, link, 1);
+	return current;
+}
+
+// Store the fat table entry for a specified link
+void store_fat (DskImage *img, uint16_t link, uint16_t next) {
+	if (link>=img->fatentries) return;
+	img->fatcache[link] = next;
+	set_freemap(img, link, !next);
+}
+
+// Check that a directory entry holds a file (or a subdirectory) and not a deleted or garbage one
+static int entry_valid (DskImage *img, direntry_t *dir) {
+	uint8_t *name = (uint8_t *)dir;
+	uint32_t i;
+
+	// Filter entries by name (name and extension)
+	for (i=0; i<11; i++) {
+		if (name[i] < 0x20 || name[i] >= 0x80) return 0;
+	}
+	if (dir->cluini >= img->totalsectors / img->bootsec->sectorsPerCluster) return 0;
+	if (dir->fsize >= img->disksize) return 0;
+	return 1;
+}
+
+// Get the information for a specified directory entry into caller storage
+int getfileinfo (DskImage *img, uint16_t dirclus, uint16_t entrypos, fileinfo_t *file) {
+	dskdir_t   *d;
+	direntry_t *dir;
+	uint32_t    aux;
+	uint32_t    i;
+
+	if ((d = get_dir(img, dirclus)) == NULL || entrypos >= d->entries) return 0;
+	dir = dir_entry(img, d, entrypos);
+	if (!entry_valid(img, dir)) return 0;
+
+	// Fill fileinfo struct
+	for (i=0; i<8; i++)
+		file->name[i] = dir->name[i]==0x20?0:dir->name[i];
+	file->name[8]=0;
+
+	for (i=0; i<3; i++)
+		file->ext[i] = dir->ext[i]==0x20?0:dir->ext[i];
+	file->ext[3]=0;
+
+	file->size = dir->fsize;
+
+	aux = dir->mtime;
+	file->sec = (aux & 0x1F)<<1;
+	file->min = (aux >> 5)&0x3F;
+	file->hour = (aux >> 11);
+
+	aux = dir->mdate;
+	file->day = (aux & 0x1F);
+	file->month = (aux >> 5) & 0xF;
+	file->year = 1980 + (aux >> 9);
+
+	file->first = dir->cluini;
+	file->pos=entrypos;
+	file->dir = dirclus;
+	file->attr = dir->attr;
+
+	return 1;
+}
+
+// Get the information for a specified ADVH directory entry into caller storage
+int getfileinfoadvh (DskImage *img, uint16_t entrypos, fileinfo_t *file) {
+	advhDirentry_t *dir;
+	uint32_t i;
+
+	dir = &((advhDirentry_t*) &img->dskimage[512+16])[entrypos];
+	if (dir->name[0]==0xff) return 0;
+	//Obtenemos datos
+	for (i=0; i<8; i++)
+		file->name[i] = dir->name[i]==0x20?0:dir->name[i];
+	file->name[8]=0;
+
+	for (i=0; i<3; i++)
+		file->ext[i] = dir->ext[i]==0x20?0:dir->ext[i];
+	file->ext[3]=0;
+	file->first = dir->secini * 512;
+	file->size = dir->secsize * 512;
+	file->pos = entrypos;
+	file->dir = 0;
+	file->attr = 0;
+
+	return 1;
+}
+
+// Start a root directory iteration
+void dir_first (DskImage *img, diriter_t *it) {
+	dir_open(img, it, 0);
+}
+
+// Start the iteration of a directory given by its first cluster
+void dir_open (DskImage *img, diriter_t *it, uint16_t dir) {
+	dskdir_t *d;
+
+	it->pos = 0;
+	it->dir = dir;
+	if (img->isADVH)
+		it->max = 190;
+	else
+		it->max = (d = get_dir(img, dir)) != NULL ? d->entries : 0;
+}
+
+// Get the next valid directory entry, skipping deleted and garbage ones and the . and .. entries
+int dir_next (DskImage *img, diriter_t *it, fileinfo_t *file) {
+	while (it->pos < it->max) {
+		if (img->isADVH) {
+			if (getfileinfoadvh(img, it->pos++, file)) return 1;
+			it->pos = it->max;
+			return 0;
+		}
+		if (getfileinfo(img, it->dir, it->pos++, file) && file->name[0]!='.') return 1;
+	}
+	return 0;
+}
+
+// Get a loaded directory, walking the chain of a subdirectory the first time
+dskdir_t *get_dir (DskImage *img, uint16_t cluster) {
+	dskdir_t *d;
+	uint32_t  current, hops, max = 4;
+
+	if (cluster==1 || cluster >= 2+img->fatelements) return NULL;
+	if (img->dirs == NULL)
+		img->dirs = (dskdir_t **) calloc(2+img->fatelements, sizeof(dskdir_t *));
+	if (img->dirs[cluster] != NULL) return img->dirs[cluster];
+
+	d = (dskdir_t *) calloc(1, sizeof(dskdir_t));
+	d->cluster = cluster;
+	if (!cluster) {
+		d->entries = img->bootsec->maxDirectoryEntries;
+	} else {
+		d->clusters = (uint16_t *) malloc(max * sizeof(uint16_t));
+		current = cluster;
+		for (hops=0; current>=2 && current<2+img->fatelements && hops<img->fatelements; hops++) {
+			if (hops == max) {
+				max *= 2;
+				d->clusters = (uint16_t *) realloc(d->clusters, max * sizeof(uint16_t));
+			}
+			d->clusters[hops] = current;
+			current = next_link(img, current);
+		}
+		d->entries = hops * (img->bytespercluster / sizeof(direntry_t));
+	}
+	img->dirs[cluster] = d;
+	return d;
+}
+
+// Get a directory entry of a loaded directory
+direntry_t *dir_entry (DskImage *img, dskdir_t *dir, uint32_t entrypos) {
+	uint32_t perclus;
+	direntry_t *entry;
+
+	if (!dir->cluster)
+		return &img->rootdir[entrypos];
+	perclus = img->bytespercluster / sizeof(direntry_t);
+	entry = (direntry_t *) (img->cluster + (dir->clusters[entrypos/perclus]-2)*img->bytespercluster) + entrypos%perclus;
+	cache_load(img, entry, sizeof(direntry_t));
+	return entry;
+}
+
+// Bucket of a padded 8.3 name in the directory index
+static uint16_t name_hash (uint8_t *name) {
+	uint32_t h = 2166136261u;
+	uint8_t  i;
+
+	for (i=0; i<11; i++)
+		h = (h ^ name[i]) * 16777619u;
+	return h % DIR_HASH_SIZE;
+}
+
+// Add an entry to the name index of a directory (if it has been built)
+static void index_add (DskImage *img, dskdir_t *dir, uint32_t entrypos) {
+	uint16_t b;
+
+	if (dir->hashhead == NULL) return;
+	b = name_hash((uint8_t *)dir_entry(img, dir, entrypos)->name);
+	dir->hashnext[entrypos] = dir->hashhead[b];
+	dir->hashhead[b] = entrypos;
+}
+
+// Remove an entry from the name index of a directory (if it has been built)
+static void index_del (DskImage *img, dskdir_t *dir, uint32_t entrypos) {
+	uint16_t *p;
+
+	if (dir->hashhead == NULL) return;
+	p = &dir->hashhead[name_hash((uint8_t *)dir_entry(img, dir, entrypos)->name)];
+	for (; *p!=0xFFFF; p=&dir->hashnext[*p]) {
+		if (*p == entrypos) {
+			*p = dir->hashnext[entrypos];
+			return;
+		}
+	}
+}
+
+// Find a padded 8.3 name in a directory, building its name index on the first lookup
+int dir_lookup (DskImage *img, dskdir_t *dir, uint8_t *name) {
+	uint32_t i;
+
+	if (dir->hashhead == NULL) {
+		dir->hashhead = (uint16_t *) malloc(DIR_HASH_SIZE * sizeof(uint16_t));
+		dir->hashnext = (uint16_t *) malloc(dir->entries * sizeof(uint16_t));
+		memset(dir->hashhead, 0xFF, DIR_HASH_SIZE * sizeof(uint16_t));
+		for (i=dir->entries; i-->0;) {
+			if (entry_valid(img, dir_entry(img, dir, i)))
+				index_add(img, dir, i);
+		}
+	}
+	for (i=dir->hashhead[name_hash(name)]; i!=0xFFFF; i=dir->hashnext[i]) {
+		if (!memcmp(dir_entry(img, dir, i)->name, name, 11)) return i;
+	}
+	return -1;
+}
+
+// Calculate the available space on the DSK
+uint32_t bytes_free (DskImage *img) {
+	return img->freeclusters*img->bytespercluster;
+}
+
+// List the entries of a directory, returning how many there are
+static int list_entries (DskImage *img, uint16_t dir) {
+	int num = 0;
+	diriter_t it;
+	fileinfo_t fileinfo, *file = &fileinfo;
+	char name[20],date[30],time[30],size[30],attrib[5];
+
+	dir_open(img, &it, dir);
+	while (dir_next(img, &it, file)) {
+		num++;
+		if (file->ext[0])
+			sprintf (name,"%.8s.%.3s",file->name,file->ext);
+		else
+			strcpy (name, file->name);
+		sprintf (size,"%7u",file->size);
+		if (file->attr&0x8) strcpy (size,"  <VOL>");
+		if (file->attr&0x10) strcpy (size,"  <DIR>");
+		sprintf (date,"%u/%02u/%u",file->day,file->month,file->year);
+		sprintf (time,"%u:%02u:%02u",file->hour,file->min,file->sec);
+		sprintf (attrib, "%c%c%c%c", file->attr&0x1?'R':'-', file->attr&0x2?'H':'-', file->attr&0x4?'S':'-', file->attr&0x20?'A':'-');
+		fprintf (img->out, "%-13s %s %10s %8s %s\n", name, size, date, time, attrib);
+	}
+	return num;
+}
+
+// List every subdirectory of a directory, recursively
+static void list_subdirs (DskImage *img, uint16_t dir, char *path, uint8_t depth) {
+	diriter_t it;
+	fileinfo_t file;
+	size_t len = strlen(path);
+
+	//MSX-DOS 2 paths can't be deeper than this
+	if (depth>=32) return;
+	dir_open(img, &it, dir);
+	while (dir_next(img, &it, &file)) {
+		if (!(file.attr&0x10) || file.first<2) continue;
+		if (file.ext[0])
+			sprintf (path+len, "\\%s.%s", file.name, file.ext);
+		else
+			sprintf (path+len, "\\%s", file.name);
+		fprintf (img->out, "\nDirectory of %s\n\n", path);
+		fputs ("Name         Bytes    Date       Time     Attr\n"
+			   "============ ======== ========== ======== ====\n", img->out);
+		if (!list_entries(img, file.first)) {
+			fputs("*** Directory is empty ***\n", img->out);
+		}
+		fputs("============ ======== ========== ======== ====\n", img->out);
+		cache_trim(img);
+		list_subdirs(img, file.first, path, depth+1);
+		path[len] = 0;
+	}
+}
+
+// List the root directory of a DSK and its subdirectories
+void list_dsk (DskImage *img) {
+	int i;
+	char name[20], path[32*13+1];
+
+	// Print Disk Volume Name
+	for (i=0; i<8; i++)
+		name[i]=img->dskimage[3+i];
+	name[8]=0;
+	fprintf (img->out, "Volume Name:  %s\n\n",name);
+
+	fputs ("Name         Bytes    Date       Time     Attr\n"
+		   "============ ======== ========== ======== ====\n", img->out);
+
+	// Iteract all entries in the root directory table
+	if (!list_entries(img, 0)) {
+		fputs("*** Disk is empty ***\n", img->out);
+	}
+	fputs("============ ======== ========== ======== ====\n", img->out);
+	path[0] = 0;
+	list_subdirs(img, 0, path, 0);
+	fprintf (img->out, "\n%u bytes free\n\n",bytes_free (img));
+}
+
+// List the directory of a DSK ADVH
+void list_advhdsk (DskImage *img) {
+	uint32_t i;
+	diriter_t it;
+	fileinfo_t file;
+	char name[20];
+
+	for (i=0; i<8; i++)
+		name[i]=img->dskimage[3+i];
+	name[8]=0;
+	fprintf (img->out, "Name of volume:   %s\n\n",name);
+	dir_first(img, &it);
+	while (dir_next(img, &it, &file)) {
+		fprintf (img->out, "%-8s.%-3s   [Diskfile Offset:%7d]  %7u bytes\n", file.name, file.ext, file.first, file.size);
+	}
+	fputs("\n", img->out);
+}
+
+// Set one pattern byte: '?' matches anything, letters match both cases
+static void set_pattern_char (pattern_t *pat, uint8_t i, char c) {
+	if (c=='?') {
+		pat->mask[i] = 0;
+	} else if (isalpha((uint8_t)c)) {
+		pat->value[i] = toupper((uint8_t)c);
+		pat->mask[i] = 0xdf;
+	} else {
+		pat->value[i] = c;
+	}
+}
+
+// Compile a filename pattern (* and ? wildcards) into the padded 8.3 layout of the directory entries
+void compile_pattern (char *name, pattern_t *pat) {
+	uint8_t i;
+
+	memset(pat->value, ' ', 11);
+	memset(pat->mask, 0xff, 11);
+
+	//name (8 chars)
+	for (i=0; *name && *name!='.'; name++) {
+		if (*name=='*') {
+			while (i<8) pat->mask[i++] = 0;
+		} else if (i<8) {
+			set_pattern_char(pat, i++, *name);
+		}
+	}
+
+	//ext (3 chars)
+	if (*name=='.') name++;
+	for (i=8; *name; name++) {
+		if (*name=='*') {
+			while (i<11) pat->mask[i++] = 0;
+		} else if (i<11) {
+			set_pattern_char(pat, i++, *name);
+		}
+	}
+}
+
+// Masked compare of a raw 11 bytes directory name against a compiled pattern
+int match_pattern (uint8_t *entry, pattern_t *pat) {
+	uint8_t diff=0;
+	uint8_t i;
+
+	for (i=0; i<11; i++)
+		diff |= (entry[i] ^ pat->value[i]) & pat->mask[i];
+	return !diff;
+}
+
+// Raw 11 bytes name of a directory entry
+static uint8_t *entry_name (DskImage *img, uint16_t dir, uint16_t entrypos) {
+	if (img->isADVH)
+		return ((advhDirentry_t*) &img->dskimage[512+16])[entrypos].name;
+	return (uint8_t *)dir_entry(img, get_dir(img, dir), entrypos)->name;
+}
+
+// Work through a directory once, running the action on the files matching any pattern
+void parse_tree (DskImage *img, uint16_t dir, pattern_t *pats, uint16_t num, dsk_action_t action) {
+	diriter_t  it;
+	fileinfo_t file;
+	uint8_t   *entry;
+	uint16_t   i;
+
+	dir_open(img, &it, dir);
+	while (dir_next(img, &it, &file)) {
+		entry = entry_name(img, dir, file.pos);
+		for (i=0; i<num; i++) {
+			if (match_pattern(entry, &pats[i])) {
+				action(img, &file);
+				break;
+			}
+		}
+		cache_trim(img);
+	}
+}
+
+// Get the contiguous cluster runs of a file chain (cached by its first cluster)
+extentmap_t *get_extents (DskImage *img, fileinfo_t *file) {
+	extentmap_t *map;
+	uint32_t     current, hops;
+
+	if (img->extentcache == NULL)
+		img->extentcache = (extentmap_t *) calloc(2+img->fatelements, sizeof(extentmap_t));
+	//Empty files share the always empty map of cluster 0
+	map = &img->extentcache[file->first < 2+img->fatelements ? file->first : 0];
+	if (map->runs != NULL) return map;
+
+	map->max = 4;
+	map->num = 0;
+	map->runs = (extent_t *) malloc(map->max * sizeof(extent_t));
+
+	//Walk the chain stopping at the end mark, a bad link or a loop
+	current = file->first;
+	for (hops=0; current>=2 && current<2+img->fatelements && hops<img->fatelements; hops++) {
+		if (map->num && map->runs[map->num-1].start+map->runs[map->num-1].count==current) {
+			map->runs[map->num-1].count++;
+		} else {
+			if (map->num == map->max) {
+				map->max *= 2;
+				map->runs = (extent_t *) realloc(map->runs, map->max * sizeof(extent_t));
+			}
+			map->runs[map->num].start = current;
+			map->runs[map->num].count = 1;
+			map->num++;
+		}
+		current = next_link(img, current);
+	}
+	return map;
+}
+
+// Forget the cached cluster runs of the chain starting at a cluster
+static void drop_extents (DskImage *img, uint32_t first) {
+	if (img->extentcache == NULL || first >= 2+img->fatelements || img->extentcache[first].runs == NULL) return;
+	free(img->extentcache[first].runs);
+	img->extentcache[first].runs = NULL;
+}
+
+// Write a range of the disk image to a file without an intermediate copy
+static void copy_range (DskImage *img, int outfd, uint32_t offset, uint32_t len, uint64_t outpos) {
+#ifndef WIN32
+	ssize_t  done;
+	uint32_t n, i, end;
+
+	//Kernel side copy from the image file, unless it misses sectors not flushed yet
+	n = img->bootsec->bytesPerSector;
+	end = (offset+len+n-1) / n;
+	for (i=offset/n; i<end && !is_dirty(img, i); i++);
+	if (img->dskfd != -1 && i==end) {
+		loff_t inoff = img->partoffset+offset, outoff = outpos;
+		while (len && (done=copy_file_range(img->dskfd, &inoff, outfd, &outoff, len, 0)) > 0) {
+			len -= done;
+		}
+		if (!len) return;
+		offset = inoff-img->partoffset;
+		outpos = outoff;
+	}
+	//Through the sector cache, one block at a time
+	while (len) {
+		n = len<CACHE_BLOCK ? len : CACHE_BLOCK;
+		cache_load(img, img->dskimage+offset, n);
+		if ((done=pwrite(outfd, img->dskimage+offset, n, outpos)) <= 0) break;
+		offset += done;
+		outpos += done;
+		len -= done;
+		cache_trim(img);
+	}
+#else
+	lseek(outfd, outpos, SEEK_SET);
+	if (write(outfd, img->dskimage+offset, len) != (int)len)
+		fprintf(img->out, "ERROR writing file\n");
+#endif
+}
+
+// Extract a subdirectory of the DSK with all its contents
+static void extract_dir (DskImage *img, fileinfo_t *file, char *name) {
+	diriter_t  it;
+	fileinfo_t sub;
+	size_t     len = strlen(img->hostpath);
+
+	fprintf (img->out, "extracting %s/\n", name);
+	if (MKDIR(name) && access(name, F_OK)) {
+		fprintf (img->out, "ERROR creating directory '%s'\n", name);
+		return;
+	}
+	//The host path of the directory just created, extension included
+	if (strlen(name)+2 > sizeof(img->hostpath)) return;
+	sprintf (img->hostpath, "%s/", name);
+	dir_open(img, &it, file->first);
+	while (dir_next(img, &it, &sub)) {
+		extract(img, &sub);
+	}
+	img->hostpath[len] = 0;
+}
+
+// Extract a file from the DSK
+void extract (DskImage *img, fileinfo_t *file) {
+	int fileid;
+	char name[300];
+	uint8_t filler[512];
+	extentmap_t *map;
+	uint32_t pos, len, i;
+
+	if (file->ext[0])
+		sprintf (name,"%s%s.%s",img->hostpath,file->name,file->ext);
+	else
+		sprintf (name,"%s%s",img->hostpath,file->name);
+	if (file->attr&0x10) {
+		extract_dir(img, file, name);
+		return;
+	}
+	fprintf (img->out, "extracting %s%s.%s\n",img->hostpath,file->name,file->ext);
+	fileid = open (name, OPEN_FLAGS, 0666);
+	if (fileid == -1) {
+		fprintf (img->out, "ERROR creating file '%s'\n", name);
+		return;
+	}
+	map = get_extents(img, file);
+	pos = 0;
+	for (i=0; i<map->num && pos<file->size; i++) {
+		len = map->runs[i].count*img->bytespercluster;
+		if (len > file->size-pos) len = file->size-pos;
+		copy_range (img, fileid, img->cluster-img->dskimage+(map->runs[i].start-2)*img->bytespercluster, len, pos);
+		pos += len;
+	}
+	//Broken chain: fill the rest of the file with EOF marks
+	memset (filler, 0x1a, sizeof(filler));
+	lseek (fileid, pos, SEEK_SET);
+	for (; pos<file->size; pos+=len) {
+		len = file->size-pos < sizeof(filler) ? file->size-pos : sizeof(filler);
+		if (write (fileid, filler, len) < 0) break;
+	}
+	close (fileid);
+}
+
+// Extract a file from the ADVH DSK
+void extract_advh (DskImage *img, fileinfo_t *file) {
+	int fileid;
+	char name[20];
+
+	fprintf (img->out, "extracting %s.%s\n",file->name,file->ext);
+	if (file->ext[0])
+		sprintf (name,"%s.%s",file->name,file->ext);
+	else
+		strcpy (name, file->name);
+	fileid = open (name, OPEN_FLAGS, 0666);
+	if (fileid == -1) {
+		fprintf (img->out, "ERROR creating file '%s'\n", name);
+		return;
+	}
+	copy_range (img, fileid, file->first, file->size, 0);
+	close (fileid);
+}
+
+// Show file clusters info from the DSK
+void file_clusters_info (DskImage *img, fileinfo_t *file) {
+	extentmap_t *map = get_extents(img, file);
+	uint16_t first, last;
+	long offset, size;
+	uint32_t i;
+
+	fprintf (img->out, "File info for %s.%s (%d bytes, %d extent%s)\n", file->name, file->ext, file->size, map->num, map->num==1?"":"s");
+	for (i=0; i<map->num; i++) {
+		first = map->runs[i].start;
+		last = first+map->runs[i].count-1;
+		//Offset in the image file, not in the partition
+		offset = img->partoffset+(img->cluster-img->dskimage)+(long)(first-2)*img->bytespercluster;
+		size = map->runs[i].count*img->bytespercluster;
+		if (first==last)
+			fprintf(img->out, "  Cluster: %04Xh (%d) | Diskfile Offset: %04lXh-%04lXh (%ld-%ld)\n", first, first, offset, offset+size-1, offset, offset+size-1);
+		else
+			fprintf(img->out, "  Clusters: %04Xh-%04Xh (%d-%d) | Diskfile Offset: %04lXh-%04lXh (%ld-%ld)\n", first, last, first, last, offset, offset+size-1, offset, offset+size-1);
+	}
+	fprintf(img->out, "\n");
+}
+
+// Set the owner of the clusters of every file in a directory and its subdirectories
+static void own_dir (DskImage *img, uint16_t dir) {
+	diriter_t    it;
+	fileinfo_t   file;
+	extentmap_t *map;
+	uint32_t     j, k, n;
+
+	dir_open(img, &it, dir);
+	while (dir_next(img, &it, &file)) {
+		//A directory already owned is a loop in a damaged tree
+		if ((file.attr&0x10) && file.first>=2 && img->clusterowner[file.first]) continue;
+		map = get_extents(img, &file);
+		for (j=0, n=0; j<map->num; j++) {
+			for (k=0; k<map->runs[j].count; k++, n++) {
+				img->clusterowner[map->runs[j].start+k] = file.pos+1;
+				img->clusterindex[map->runs[j].start+k] = n;
+				img->clusterdir[map->runs[j].start+k] = dir;
+			}
+		}
+		if ((file.attr&0x10) && file.first>=2)
+			own_dir(img, file.first);
+	}
+	cache_trim(img);
+}
+
+// Build the reverse index from clusters (or ADVH sectors) to directory entries
+void build_owner_index (DskImage *img) {
+	diriter_t    it;
+	fileinfo_t   file;
+	uint32_t     j, n, total;
+
+	dir_first(img, &it);
+	if (img->isADVH) {
+		total = img->disksize/512;
+		img->clusterowner = (uint16_t *) calloc(total, sizeof(uint16_t));
+		img->clusterindex = (uint16_t *) calloc(total, sizeof(uint16_t));
+		while (dir_next(img, &it, &file)) {
+			for (j=file.first/512, n=0; n<file.size/512 && j<total; j++, n++) {
+				img->clusterowner[j] = file.pos+1;
+				img->clusterindex[j] = n;
+			}
+		}
+		return;
+	}
+
+	total = 2+img->fatelements;
+	img->clusterowner = (uint16_t *) calloc(total, sizeof(uint16_t));
+	img->clusterindex = (uint16_t *) calloc(total, sizeof(uint16_t));
+	img->clusterdir = (uint16_t *) calloc(total, sizeof(uint16_t));
+	own_dir(img, 0);
+}
+
+// Show which file owns a raw ADVH disk offset
+void offset_info_advh (DskImage *img, uint32_t offset) {
+	fileinfo_t  file;
+	uint32_t    sector, pos;
+
+	fprintf (img->out, "Offset %u (%Xh): ", offset, offset);
+	if (offset >= img->disksize) {
+		fprintf (img->out, "out of the disk image\n");
+		return;
+	}
+	if (offset < 512) {
+		fprintf (img->out, "Boot sector\n");
+		return;
+	}
+	sector = offset/512;
+	if (!img->clusterowner[sector]) {
+		fprintf (img->out, "%s sector %u\n", offset<3584 ? "Root directory" : "Unused", sector);
+		return;
+	}
+	getfileinfoadvh(img, img->clusterowner[sector]-1, &file);
+	pos = img->clusterindex[sector]*512 + offset%512;
+	fprintf (img->out, "%s.%s | Sector: %u | File offset: %u\n", file.name, file.ext, sector, pos);
+}
+
+// Show which file owns a raw offset of the image file (a partition starts at img->partoffset)
+void offset_info (DskImage *img, uint64_t fileoffset) {
+	fileinfo_t  file;
+	uint32_t    offset, clus, pos;
+	uint32_t    fatini = img->fat-img->dskimage;
+	uint32_t    rootini = (uint8_t *)img->rootdir-img->dskimage;
+	uint32_t    clusterini = img->cluster-img->dskimage;
+
+	fprintf (img->out, "Offset %llu (%llXh): ", (unsigned long long)fileoffset, (unsigned long long)fileoffset);
+	if (fileoffset < img->partoffset) {
+		fprintf (img->out, "before the partition\n");
+		return;
+	}
+	if (fileoffset-img->partoffset >= img->disksize) {
+		fprintf (img->out, "out of the disk image\n");
+		return;
+	}
+	offset = fileoffset-img->partoffset;
+	if (offset < fatini) {
+		fprintf (img->out, "Boot sector\n");
+		return;
+	}
+	if (offset < rootini) {
+		fprintf (img->out, "FAT#%u\n", 1+(offset-fatini)/(img->bootsec->sectorsPerFAT*img->bootsec->bytesPerSector));
+		return;
+	}
+	if (offset < clusterini) {
+		fprintf (img->out, "Root directory entry %u\n", (offset-rootini)/(uint32_t)sizeof(direntry_t));
+		return;
+	}
+	clus = (offset-clusterini)/img->bytespercluster + 2;
+	if (clus >= 2+img->fatelements || !img->clusterowner[clus]) {
+		fprintf (img->out, "%s cluster %04Xh (%d)\n", next_link(img, clus) ? "Orphan" : "Free", clus, clus);
+		return;
+	}
+	getfileinfo(img, img->clusterdir[clus], img->clusterowner[clus]-1, &file);
+	pos = img->clusterindex[clus]*img->bytespercluster + (offset-clusterini)%img->bytespercluster;
+	fprintf (img->out, "%s.%s | Cluster: %04Xh (%d) | File offset: %u%s\n", file.name, file.ext, clus, clus, pos,
+		file.attr&0x10 ? " [directory]" : pos>=file.size ? " [slack]" : "");
+}
+
+// Wipe a DSK by clearing the directory
+void wipe (DskImage *img, fileinfo_t *file) {
+	extentmap_t *map = get_extents(img, file);
+	dskdir_t *d;
+	uint32_t i, j;
+
+	for (i=0; i<map->num; i++) {
+		for (j=0; j<map->runs[i].count; j++) {
+			remove_link (img, map->runs[i].start+j);
+		}
+	}
+	drop_extents(img, file->first);
+	d = get_dir(img, file->dir);
+	index_del(img, d, file->pos);
+	dir_entry(img, d, file->pos)->name[0] = 0xE5;
+	mark_dirty(img, dir_entry(img, d, file->pos), 1);
+}
+
+// Remove a file from the DSK
+void deleted (DskImage *img, fileinfo_t *file) {
+	if (file->attr&0x10) {
+		fprintf (img->out, "skipping directory %s\n",file->name);
+		return;
+	}
+	fprintf (img->out, "deleting %s.%s\n",file->name,file->ext);
+	wipe (img, file);
+}
+
+// Mirror the modified FAT#1 sectors to the other FAT copies
+static void mirror_fat (DskImage *img) {
+	bootsec_t *bootsec = img->bootsec;
+	uint32_t fatsize = bootsec->bytesPerSector * bootsec->sectorsPerFAT;
+	uint32_t i, k;
+	uint8_t *copy;
+
+	for (k=1; k<bootsec->numberOfFATs; k++) {
+		copy = img->fat + k*fatsize;
+		for (i=0; i<fatsize; i+=bootsec->bytesPerSector) {
+			if (memcmp(copy+i, img->fat+i, bootsec->bytesPerSector)) {
+				memcpy(copy+i, img->fat+i, bootsec->bytesPerSector);
+				mark_dirty(img, copy+i, bootsec->bytesPerSector);
+			}
+		}
+	}
+}
+
+// Check that a cluster was freed since the load and it's still free
+static int is_freed (DskImage *img, uint32_t clus) {
+	return img->freedmap[clus>>3] & img->freemap[clus>>3] & (1<<(clus&7));
+}
+
+// Find the next run of clusters freed since the load and still free, from the cluster *start (0: none left)
+static uint32_t next_freed (DskImage *img, uint32_t *start) {
+	uint32_t i = *start, j;
+
+	if (img->freedmap == NULL) return 0;
+	for (; i<2+img->fatelements && !is_freed(img, i); i++);
+	for (j=i; j<2+img->fatelements && is_freed(img, j); j++);
+	*start = i;
+	return j-i;
+}
+
+// Release the data of the freed clusters: holes in the image file, zeros in a compressed image
+static void release_freed (DskImage *img) {
+	uint32_t i, n, bpc = img->bytespercluster;
+
+	for (i=2; (n = next_freed(img, &i)); i+=n) {
+		if (img->pack != NULL) {
+			memset(img->cluster+(i-2)*bpc, 0, n*bpc);
+			continue;
+		}
+#if !defined(WIN32) && defined(FALLOC_FL_PUNCH_HOLE)
+		//Not supported by every filesystem: the data is just left there then
+		if (img->dskfd != -1)
+			fallocate(img->dskfd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+				img->partoffset+(img->cluster-img->dskimage)+(uint64_t)(i-2)*bpc, (uint64_t)n*bpc);
+#endif
+	}
+	if (img->freedmap != NULL)
+		memset(img->freedmap, 0, (2+img->fatelements+7)/8);
+}
+
+// Check that a range of the image holds only zeros
+static int is_zero (uint8_t *data, uint32_t len) {
+	return !len || (!data[0] && !memcmp(data, data+1, len-1));
+}
+
+// Container of a new image, from the extension of its name (0 for a plain image)
+static uint8_t pack_type (char *name) {
+	char  *ext = strrchr(name, '.');
+	char   low[5];
+	size_t i;
+
+	if (ext==NULL || strlen(ext)>4) return 0;
+	for (i=0; i<=strlen(ext); i++) low[i] = tolower(ext[i]);
+	if (!strcmp(low, ".xsa")) return PACK_XSA;
+#ifdef HAVE_ZLIB
+	if (!strcmp(low, ".gz")) return PACK_GZIP;
+#endif
+#ifdef HAVE_ZSTD
+	if (!strcmp(low, ".zst")) return PACK_ZSTD;
+#endif
+	return 0;
+}
+
+// Compress the whole image, replacing the file once it's complete
+static int flush_pack (DskImage *img, char *name, uint8_t type) {
+	FILE    *file;
+	char     tmpname[1040], orig[256], *p;
+	uint32_t size = img->disksize;
+	int      ret = DSK_ERR_IMAGE;
+
+	if (img->pack != NULL) {
+		if (img->pack->size > size) size = img->pack->size;
+		pack_decode(img, size);
+		release_freed(img);
+		strcpy(orig, img->pack->name);
+	} else {
+		//New image: the original name is the file name without the container extension
+		p = strrchr(name, '/');
+		snprintf(orig, sizeof(orig)-4, "%s", p ? p+1 : name);
+		if ((p = strrchr(orig, '.')) != NULL) *p = 0;
+		if (strchr(orig, '.') == NULL) strcat(orig, ".dsk");
+	}
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", name);
+	if ((file = fopen(tmpname, "wb")) == NULL) {
+		fprintf (img->out, "ERROR writing .DSK image\n");
+		return DSK_ERR_IMAGE;
+	}
+	switch (type) {
+		case PACK_XSA:  ret = xsa_write(img, file, img->dskimage, size, orig); break;
+#ifdef HAVE_ZLIB
+		case PACK_GZIP: ret = gz_write(img, file, img->dskimage, size, orig); break;
+#endif
+#ifdef HAVE_ZSTD
+		case PACK_ZSTD: ret = zst_write(img, file, img->dskimage, size); break;
+#endif
+	}
+	if (fclose(file) || ret || rename(tmpname, name)) {
+		fprintf (img->out, "ERROR writing .DSK image\n");
+		remove(tmpname);
+		return DSK_ERR_IMAGE;
+	}
+	memset (img->dirtymap, 0, (img->totalsectors+7)/8);
+	return DSK_OK;
+}
+
+// Write the image whole to a plain file: only the sectors holding data, the rest is left as a hole
+static int write_flat (DskImage *img, char *name, uint32_t size) {
+	int      ret = DSK_OK;
+#ifndef WIN32
+	uint32_t bps = img->bootsec->bytesPerSector;
+	uint32_t first, last, end, total = (size+bps-1)/bps;
+	uint32_t len;
+	int      fd = open (name, O_RDWR|O_CREAT|O_TRUNC, 0666);
+
+	//One cache block at a time: a cached image is read and dropped as it's written
+	for (first=0; fd!=-1 && first<total; cache_trim(img)) {
+		end = first + CACHE_BLOCK/bps < total ? first + CACHE_BLOCK/bps : total;
+		cache_load(img, img->dskimage+first*bps, (end-first)*bps);
+		for (; first<end; first=last) {
+			if (is_zero(img->dskimage+first*bps, bps)) {
+				last = first+1;
+				continue;
+			}
+			for (last=first+1; last<end && !is_zero(img->dskimage+last*bps, bps); last++);
+			len = (last-first)*bps;
+			if (first*bps+len > size) len = size-first*bps;
+			if (pwrite (fd, img->dskimage+first*bps, len, (uint64_t)first*bps) != (ssize_t)len) break;
+		}
+		if (first<end) break;
+	}
+	if (fd==-1 || first<total || ftruncate (fd, size)) {
+		fprintf (img->out, "ERROR writing .DSK image\n");
+		ret = DSK_ERR_IMAGE;
+	}
+	if (fd!=-1) close (fd);
+#else
+	FILE    *file = fopen (name, "w+b");
+
+	if (file==NULL || fwrite (img->dskimage, 1, size, file)!=size) {
+		fprintf (img->out, "ERROR writing .DSK image\n");
+		ret = DSK_ERR_IMAGE;
+	}
+	if (file!=NULL) fclose (file);
+#endif
+	return ret;
+}
+
+// Write an overlay image again with its previous sectors and the modified ones
+static int flush_overlay (DskImage *img, char *name) {
+	struct pack_s *p = img->pack;
+	ovlheader_t head;
+	FILE     *file;
+	char      tmpname[1040];
+	uint32_t *sec, i, k, num = 0, total = p->size/p->ovlbps;
+	uint8_t  *keep;
+	int       ret = DSK_OK;
+
+	pack_decode(img, p->size);
+	if (p->error) return DSK_ERR_IMAGE;
+	keep = (uint8_t *) calloc((total+7)/8, 1);
+	for (k=0; k<p->ovlnum; k++)
+		keep[p->ovlsec[k]>>3] |= 1<<(p->ovlsec[k]&7);
+	sec = (uint32_t *) malloc(total*sizeof(uint32_t)+1);
+	for (i=0; i<total; i++) {
+		if ((keep[i>>3] & (1<<(i&7))) || (i<img->totalsectors && is_dirty(img, i))) sec[num++] = i;
+	}
+	free(keep);
+
+	memcpy(head.magic, OVL_MAGIC, 8);
+	head.size = p->size;
+	head.bytesPerSector = p->ovlbps;
+	head.namelen = strlen(p->name);
+	head.sectors = num;
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", name);
+	if ((file = fopen(tmpname, "wb")) == NULL) {
+		fprintf (img->out, "ERROR writing .DSK image\n");
+		free(sec);
+		return DSK_ERR_IMAGE;
+	}
+	if (fwrite(&head, sizeof(head), 1, file) != 1 || fwrite(p->name, 1, head.namelen, file) != head.namelen ||
+	    fwrite(sec, sizeof(uint32_t), num, file) != num) ret = DSK_ERR_IMAGE;
+	for (k=0; k<num && !ret; k++) {
+		if (fwrite(img->dskimage+sec[k]*p->ovlbps, p->ovlbps, 1, file) != 1) ret = DSK_ERR_IMAGE;
+	}
+	if (fclose(file) || ret || rename(tmpname, name)) {
+		fprintf (img->out, "ERROR writing .DSK image\n");
+		remove(tmpname);
+		free(sec);
+		return DSK_ERR_IMAGE;
+	}
+	//The sectors are taken from the image from now on
+	free(p->ovlsec);
+	p->ovlsec = sec;
+	p->ovlnum = num;
+	memset (img->dirtymap, 0, (img->totalsectors+7)/8);
+	return DSK_OK;
+}
+
+// Create an overlay image over a read-only base image: nothing but its header until it's modified
+int create_overlay (DskImage *img, char *base, char *name) {
+	ovlheader_t head;
+	bootsec_t   boot;
+	FILE       *file;
+	char        path[1024];
+	uint64_t    size;
+	int         ret = DSK_OK;
+
+	//The base is found by its full path from anywhere
+#ifdef WIN32
+	if (_fullpath(path, base, sizeof(path)) == NULL) *path = 0;
+#else
+	if (realpath(base, path) == NULL) *path = 0;
+#endif
+	if (!*path || (file = fopen(path, "rb")) == NULL) {
+		fprintf (img->out, "ERROR base image %s not found\n", base);
+		return DSK_ERR_IMAGE;
+	}
+	//Overlays and compressed images can't be read in place
+	if (fread(&boot, sizeof(boot), 1, file) != 1 || pack_magic((uint8_t *)&boot, sizeof(boot)) || fseek(file, 0, SEEK_END) ||
+	    (size = ftell(file)) > 0xFFFFFFFF || strlen(path) >= sizeof(((struct pack_s *)0)->name) ||
+	    boot.bytesPerSector < 128 || size % boot.bytesPerSector) {
+		fprintf (img->out, "ERROR the base image must be a plain .DSK image\n");
+		fclose(file);
+		return DSK_ERR_IMAGE;
+	}
+	fclose(file);
+
+	memcpy(head.magic, OVL_MAGIC, 8);
+	head.size = size;
+	head.bytesPerSector = boot.bytesPerSector;
+	head.namelen = strlen(path);
+	head.sectors = 0;
+	if ((file = fopen(name, "wb")) == NULL || fwrite(&head, sizeof(head), 1, file) != 1 || fwrite(path, 1, head.namelen, file) != head.namelen) {
+		fprintf (img->out, "ERROR writing .DSK image\n");
+		ret = DSK_ERR_IMAGE;
+	}
+	if (file != NULL && fclose(file)) ret = DSK_ERR_IMAGE;
+	return ret;
+}
+
+// Write an overlay (or a compressed image) as a plain image, in place or to another file
+int merge_dsk (DskImage *img, char *name, char *output) {
+	char     tmpname[1040];
+	uint32_t size = img->disksize;
+
+	if (img->pack == NULL && (output == NULL || !strcmp(output, name))) {
+		fputs ("Already a plain image\n\n", img->out);
+		return DSK_OK;
+	}
+	//A compressed image is decoded whole, a cached one is read by write_flat block by block
+	if (img->pack != NULL && img->pack->size > size) size = img->pack->size;
+	if (img->pack != NULL) cache_load(img, img->dskimage, size);
+	if (img->pack != NULL && img->pack->error) return DSK_ERR_IMAGE;
+	if (output == NULL) output = name;
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", output);
+	if (write_flat(img, tmpname, size) || rename(tmpname, output)) {
+		remove(tmpname);
+		return DSK_ERR_IMAGE;
+	}
+	fprintf (img->out, "*** Plain image %s written ***\n\n", output);
+	return DSK_OK;
+}
+
+// FNV-1a hash of a sector, to check the image a delta is applied to
+static uint32_t sector_hash (uint8_t *data, uint32_t len) {
+	uint32_t h = 2166136261u;
+
+	while (len--) h = (h ^ *data++) * 16777619u;
+	return h;
+}
+
+// Write the sectors of an image that differ from an older one with the same geometry,
+// skipping the clusters that are free in the new image
+int diff_dsk (DskImage *old, DskImage *img, char *name) {
+	bootsec_t  *b = img->bootsec, *ob = old->bootsec;
+	ovlheader_t head;
+	FILE       *file;
+	uint32_t    bps = b->bytesPerSector, total = img->totalsectors;
+	uint32_t    rootsec = (img->rootdir-(direntry_t *)img->dskimage)*sizeof(direntry_t)/bps;
+	uint32_t    datasec = (img->cluster-img->dskimage)/bps;
+	uint32_t    count[3] = { 0, 0, 0 }, used = 0;
+	uint32_t   *sec, *hash, i, clus, num = 0;
+	uint8_t    *p, *q;
+	int         ret = DSK_OK;
+
+	if (img->disksize != old->disksize || bps != ob->bytesPerSector || b->sectorsPerCluster != ob->sectorsPerCluster ||
+	    b->reservedSectors != ob->reservedSectors || b->sectorsPerFAT != ob->sectorsPerFAT ||
+	    b->numberOfFATs != ob->numberOfFATs || b->maxDirectoryEntries != ob->maxDirectoryEntries) {
+		fprintf (img->out, "ERROR the images have a different geometry\n");
+		return DSK_ERR_FORMAT;
+	}
+	sec = (uint32_t *) malloc(total*sizeof(uint32_t)+1);
+	hash = (uint32_t *) malloc(total*sizeof(uint32_t)+1);
+	for (i=0; i<total; i++) {
+		//The contents of free clusters don't matter
+		clus = i<datasec ? 0 : 2+(i-datasec)/b->sectorsPerCluster;
+		if (clus && clus<2+img->fatelements && (img->freemap[clus>>3] & (1<<(clus&7)))) continue;
+		if (clus && (i-datasec)%b->sectorsPerCluster == 0) used++;
+		p = img->dskimage+i*bps;
+		q = old->dskimage+i*bps;
+		cache_load(img, p, bps);
+		cache_load(old, q, bps);
+		if (!(i&1023)) {
+			cache_trim(img);
+			cache_trim(old);
+		}
+		if (!memcmp(p, q, bps)) continue;
+		count[i<rootsec ? 0 : i<datasec ? 1 : 2]++;
+		hash[num] = sector_hash(q, bps);
+		sec[num++] = i;
+	}
+
+	memcpy(head.magic, DLT_MAGIC, 8);
+	head.size = img->disksize;
+	head.bytesPerSector = bps;
+	head.namelen = 0;
+	head.sectors = num;
+	if ((file = fopen(name, "wb")) == NULL || fwrite(&head, sizeof(head), 1, file) != 1 ||
+	    fwrite(sec, sizeof(uint32_t), num, file) != num || fwrite(hash, sizeof(uint32_t), num, file) != num) ret = DSK_ERR_IMAGE;
+	for (i=0; i<num && !ret; i++) {
+		cache_load(img, img->dskimage+sec[i]*bps, bps);
+		if (fwrite(img->dskimage+sec[i]*bps, bps, 1, file) != 1) ret = DSK_ERR_IMAGE;
+		if (!(i&63)) cache_trim(img);
+	}
+	if (file != NULL && fclose(file)) ret = DSK_ERR_IMAGE;
+	free(sec);
+	free(hash);
+	if (ret) {
+		fprintf (img->out, "ERROR writing delta file\n");
+		return ret;
+	}
+	fprintf (img->out, "Boot sector and FAT: %u | Directory: %u | Clusters: %u sectors of %u clusters in use\n",
+		count[0], count[1], count[2], used);
+	fprintf (img->out, "*** Delta with %u sectors (%u bytes) written ***\n\n", num, num*(bps+8)+(uint32_t)sizeof(head));
+	return DSK_OK;
+}
+
+// Apply a delta in place, once all the sectors it replaces are checked
+int patch_dsk (DskImage *img, char *name) {
+	ovlheader_t head;
+	FILE       *file;
+	uint32_t   *sec = NULL, *hash = NULL, bps = img->bootsec->bytesPerSector;
+	uint32_t    k, done = 0, wrong = 0;
+	uint8_t    *data = NULL, *p;
+	int         ret = DSK_ERR_IMAGE;
+
+	if ((file = fopen(name, "rb")) == NULL || fread(&head, sizeof(head), 1, file) != 1 || memcmp(head.magic, DLT_MAGIC, 8)) {
+		fprintf (img->out, "ERROR bad delta file\n");
+		goto done;
+	}
+	if (head.size != img->disksize || head.bytesPerSector != bps) {
+		fprintf (img->out, "ERROR the delta is for an image with a different geometry\n");
+		goto done;
+	}
+	sec = (uint32_t *) malloc(head.sectors*sizeof(uint32_t)+1);
+	hash = (uint32_t *) malloc(head.sectors*sizeof(uint32_t)+1);
+	data = (uint8_t *) malloc((size_t)head.sectors*bps+1);
+	if (fread(sec, sizeof(uint32_t), head.sectors, file) != head.sectors || fread(hash, sizeof(uint32_t), head.sectors, file) != head.sectors ||
+	    fread(data, bps, head.sectors, file) != head.sectors) {
+		fprintf (img->out, "ERROR bad delta file\n");
+		goto done;
+	}
+
+	//Every sector must hold its old contents (or the new ones already) before anything is touched
+	for (k=0; k<head.sectors; k++) {
+		if (sec[k] >= img->totalsectors) {
+			wrong++;
+			continue;
+		}
+		p = img->dskimage+sec[k]*bps;
+		cache_load(img, p, bps);
+		if (!memcmp(p, data+k*bps, bps))
+			done++;
+		else if (sector_hash(p, bps) != hash[k])
+			wrong++;
+	}
+	if (wrong) {
+		fprintf (img->out, "ERROR the image doesn't match the delta (%u sectors differ)\n", wrong);
+		goto done;
+	}
+	for (k=0; k<head.sectors; k++) {
+		p = img->dskimage+sec[k]*bps;
+		cache_load(img, p, bps);
+		if (memcmp(p, data+k*bps, bps)) {
+			memcpy(p, data+k*bps, bps);
+			mark_dirty(img, p, bps);
+		}
+	}
+	//The FAT and the directories may have changed under everything decoded from them
+	drop_caches(img);
+	if (!img->isADVH) {
+		free(img->fatcache);
+		unpack_fat(img);
+		free(img->freemap);
+		build_freemap(img);
+		if (img->freedmap != NULL)
+			memset(img->freedmap, 0, (2+img->fatelements+7)/8);
+	}
+	fprintf (img->out, "%u sectors patched, %u already up to date\n\n", head.sectors-done, done);
+	ret = DSK_OK;
+done:
+	if (file != NULL) fclose(file);
+	free(sec);
+	free(hash);
+	free(data);
+	return ret;
+}
+
+// Write the in memory copy to the DSK file
+int flush_dsk (DskImage *img, char *name) {
+	uint32_t first, last, total = img->totalsectors;
+	uint32_t bps = img->bootsec->bytesPerSector;
+	int      ret = DSK_OK;
+#ifdef WIN32
+	FILE    *file;
+	char     path[1024];
+#endif
+
+	pack_fat (img);
+	mirror_fat (img);
+
+	//Compressed image: written again whole when modified (an overlay with the modified sectors)
+	if (img->pack != NULL || (img->dsknew && pack_type(name))) {
+		for (first=0; !img->dsknew && first<(total+7)/8 && !img->dirtymap[first]; first++);
+		if (!img->dsknew && first==(total+7)/8) return DSK_OK;
+		if (img->pack != NULL && img->pack->type == PACK_OVERLAY) return flush_overlay(img, name);
+		return flush_pack(img, name, img->pack ? img->pack->type : pack_type(name));
+	}
+
+	//New image: written whole
+	if (img->dsknew)
+		return write_flat(img, name, img->disksize);
+
+	//Write back only the runs of modified sectors
+#ifdef WIN32
+	name = split_partition (img, name, path);
+	file=fopen (name, "r+b");
+#endif
+	for (first=0; first<total; first=last) {
+		if (!is_dirty(img, first)) {
+			last = first+1;
+			continue;
+		}
+		for (last=first+1; last<total && is_dirty(img, last); last++);
+#ifdef WIN32
+		FSEEK64 (file, img->partoffset+(uint64_t)first*bps);
+		fwrite (img->dskimage+first*bps, 1, (last-first)*bps, file);
+#else
+		if (pwrite (img->dskfd, img->dskimage+first*bps, (last-first)*bps, img->partoffset+(uint64_t)first*bps) < 0) {
+			fprintf (img->out, "ERROR writing .DSK image\n");
+			ret = DSK_ERR_IMAGE;
+			break;
+		}
+#endif
+	}
+#ifdef WIN32
+	fclose (file);
+#endif
+	memset (img->dirtymap, 0, (total+7)/8);
+	if (!ret) release_freed (img);
+	return ret;
+}
+
+// Find the smallest free run holding the requested clusters (0 if there is none)
+static uint32_t find_best_run (DskImage *img, uint32_t total) {
+	uint32_t i, start, best = 0, bestlen = 0;
+
+	i = img->nextfree;
+	while ((start = find_free(img, i))) {
+		for (i=start+1; i<2+img->fatelements && (img->freemap[i>>3] & (1<<(i&7))); i++);
+		if (i-start>=total && (!best || i-start<bestlen)) {
+			best = start;
+			bestlen = i-start;
+			if (bestlen==total) break;
+		}
+	}
+	return best;
+}
+
+// Store a host filename in the padded upper case 8.3 layout of the directory entries
+static void pad_name (char *name, uint8_t *padded) {
+	uint8_t i;
+
+	memset(padded, ' ', 11);
+	for (i=0; *name && *name!='.'; name++) {
+		if (i<8) padded[i++] = toupper((uint8_t)*name);
+	}
+	if (*name=='.') name++;
+	for (i=8; *name && i<11; name++) {
+		padded[i++] = toupper((uint8_t)*name);
+	}
+}
+
+// Write host data to the clusters of a cached image straight into the image file
+static int write_through (DskImage *img, FILE *fileid, uint8_t *buf, uint8_t *dst, uint32_t len, uint32_t n) {
+#ifndef WIN32
+	uint32_t off, k, r;
+
+	for (off=0; off<len; off+=k) {
+		k = len-off<CACHE_BLOCK ? len-off : CACHE_BLOCK;
+		r = n>off ? (n-off<k ? n-off : k) : 0;
+		if (fread(buf, 1, r, fileid) != r) return DSK_ERR_FILE;
+		memset(buf+r, 0, k-r);
+		if (pwrite(img->dskfd, buf, k, img->partoffset+(dst+off-img->dskimage)) != (ssize_t)k) return DSK_ERR_IMAGE;
+	}
+#endif
+	return DSK_OK;
+}
+
+// Copy a planned file from the host straight into its allocated clusters
+static int read_planned (DskImage *img, addplan_t *plan) {
+	FILE     *fileid;
+	uint8_t  *dst, *buf = NULL;
+	uint32_t  i, len, n, left = plan->size;
+	int       ret = DSK_OK;
+
+	if ((fileid = fopen(plan->fullname, "rb")) == NULL) return DSK_ERR_FILE;
+	//The data of a cached image doesn't go through the cache
+	if (img->dskcached) buf = (uint8_t *) malloc(CACHE_BLOCK);
+	for (i=0; i<plan->map->num && !ret; i++) {
+		dst = img->cluster + (plan->map->runs[i].start-2)*img->bytespercluster;
+		len = plan->map->runs[i].count*img->bytespercluster;
+		n = left<len ? left : len;
+		if (buf != NULL) {
+			ret = write_through(img, fileid, buf, dst, len, n);
+		} else if (fread(dst, 1, n, fileid) != n) {
+			ret = DSK_ERR_FILE;
+		} else {
+			memset(dst+n, 0, len-n);
+		}
+		left -= n;
+	}
+	free(buf);
+	fclose(fileid);
+	return ret;
+}
+
+#ifndef WIN32
+typedef struct {
+	DskImage        *img;
+	addplan_t       *plan;
+	int              num;
+	int              next;
+	pthread_mutex_t  lock;
+} addreaders_t;
+
+// Reader thread: take the next planned file until all of them are copied
+static void *add_reader (void *arg) {
+	addreaders_t *readers = (addreaders_t *) arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&readers->lock);
+		i = readers->next++;
+		pthread_mutex_unlock(&readers->lock);
+		if (i>=readers->num) break;
+		if (!readers->plan[i].skip)
+			readers->plan[i].status = read_planned(readers->img, &readers->plan[i]);
+	}
+	return NULL;
+}
+#endif
+
+// Copy all the planned files, reading several host files at once when possible
+static void read_plan (DskImage *img, addplan_t *plan, int num) {
+	int i;
+#ifndef WIN32
+	addreaders_t readers;
+	pthread_t    threads[ADD_READERS];
+	int          nthreads = num<ADD_READERS ? num : ADD_READERS;
+
+	if (nthreads>1) {
+		readers.img = img;
+		readers.plan = plan;
+		readers.num = num;
+		readers.next = 0;
+		pthread_mutex_init(&readers.lock, NULL);
+		for (i=0; i<nthreads; i++) {
+			if (pthread_create(&threads[i], NULL, add_reader, &readers)) break;
+		}
+		nthreads = i;
+		add_reader(&readers);
+		for (i=0; i<nthreads; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		pthread_mutex_destroy(&readers.lock);
+		return;
+	}
+#endif
+	for (i=0; i<num; i++) {
+		if (!plan[i].skip)
+			plan[i].status = read_planned(img, &plan[i]);
+	}
+}
+
+// Set the modification time of a directory entry
+static void set_entry_time (direntry_t *dir, time_t t) {
+	struct tm ti;
+
+	localtime_r(&t, &ti);
+	dir->mtime = (ti.tm_sec>>1)+(ti.tm_min<<5)+(ti.tm_hour<<11);
+	dir->mdate = (ti.tm_mday)+(ti.tm_mon<<5)+((ti.tm_year+1900-1980)<<9);
+}
+
+// Add a cluster to a full subdirectory chain
+static int grow_dir (DskImage *img, dskdir_t *d) {
+	uint32_t perclus = img->bytespercluster / sizeof(direntry_t);
+	uint32_t n = d->entries / perclus;
+	uint32_t c;
+
+	if (!d->cluster || !n || !(c = find_free(img, img->nextfree))) return 0;
+	store_fat(img, d->clusters[n-1], c);
+	store_fat(img, c, img->fateoc);
+	cache_load(img, img->cluster+(c-2)*img->bytespercluster, img->bytespercluster);
+	memset(img->cluster+(c-2)*img->bytespercluster, 0, img->bytespercluster);
+	mark_dirty(img, img->cluster+(c-2)*img->bytespercluster, img->bytespercluster);
+	d->clusters = (uint16_t *) realloc(d->clusters, (n+1) * sizeof(uint16_t));
+	d->clusters[n] = c;
+	d->entries += perclus;
+	if (d->hashnext != NULL)
+		d->hashnext = (uint16_t *) realloc(d->hashnext, d->entries * sizeof(uint16_t));
+	drop_extents(img, d->cluster);
+	return 1;
+}
+
+// First free entry of a directory from a position, growing a subdirectory when it is full (-1: no room)
+static int dir_free_slot (DskImage *img, dskdir_t *d, uint32_t from) {
+	direntry_t *dir;
+
+	for (; from<d->entries; from++) {
+		dir = dir_entry(img, d, from);
+		if ((uint8_t)dir->name[0]<0x20 || (uint8_t)dir->name[0]>=0x80) return from;
+	}
+	return grow_dir(img, d) ? (int)from : -1;
+}
+
+// Check that everything inside a host directory can be read, before the DSK is modified
+static int check_host_tree (DskImage *img, char *path) {
+	DIR           *hostdir;
+	struct dirent *ent;
+	struct stat    attr;
+	FILE          *fileid;
+	char          *name;
+	int            ret = DSK_OK;
+
+	if ((hostdir = opendir(path)) == NULL) {
+		fprintf(img->out, "ERROR reading '%s' directory\n", path);
+		return DSK_ERR_FILE;
+	}
+	while (!ret && (ent = readdir(hostdir)) != NULL) {
+		if (ent->d_name[0]=='.') continue;
+		name = (char *) malloc(strlen(path)+strlen(ent->d_name)+2);
+		sprintf(name, "%s/%s", path, ent->d_name);
+		if (stat(name, &attr)) {
+			fprintf(img->out, "ERROR reading '%s' file\n", name);
+			ret = DSK_ERR_FILE;
+		} else if (S_ISDIR(attr.st_mode)) {
+			ret = check_host_tree(img, name);
+		} else if (!S_ISREG(attr.st_mode) || (fileid = fopen(name, "rb")) == NULL) {
+			fprintf(img->out, "ERROR reading file '%s'\n", name);
+			ret = DSK_ERR_FILE;
+		} else {
+			fclose(fileid);
+		}
+		free(name);
+	}
+	closedir(hostdir);
+	return ret;
+}
+
+// Add a list of host files to a directory of the DSK
+int add_files (DskImage *img, uint16_t dirclus, char **names, int num) {
+	return add_planned(img, dirclus, names, num, 0);
+}
+
+// Plan everything first, then copy the data. Host directories are created in the DSK and added
+// recursively after the files, their whole tree checked up front (checked: done by the caller).
+static int add_planned (DskImage *img, uint16_t dirclus, char **names, int num, uint8_t checked) {
+	addplan_t  *plan;
+	uint8_t    *replace;
+	dskdir_t   *d = get_dir(img, dirclus);
+	fileinfo_t  file;
+	extentmap_t *map;
+	direntry_t *dir;
+	struct stat attr;
+	FILE       *fileid;
+	uint64_t    needed = 0;
+	uint32_t    reclaimed = 0, freeslots = 0, slots = 0;
+	uint32_t    perclus = img->bytespercluster / sizeof(direntry_t);
+	uint32_t    total, current, prev, i, k;
+	int         j, pos, ret = DSK_OK;
+	char        base[250], *p;
+
+	plan = (addplan_t *) calloc(num, sizeof(addplan_t));
+	replace = (uint8_t *) calloc(d->entries, 1);
+
+	//Stat all the input files
+	for (j=0; j<num; j++) {
+		if (stat(names[j], &attr)) {
+			fprintf(img->out, "ERROR reading '%s' file\n", names[j]);
+			ret = DSK_ERR_FILE;
+			goto done;
+		}
+		strncpy(plan[j].fullname, names[j], sizeof(plan[j].fullname)-1);
+		//basename() may modify its argument
+		strcpy(base, plan[j].fullname);
+		strncpy(plan[j].name, basename(base), sizeof(plan[j].name)-1);
+		if (S_ISDIR(attr.st_mode)) {
+			plan[j].isdir = plan[j].skip = 1;
+			if (!checked && (ret = check_host_tree(img, names[j]))) goto done;
+			continue;
+		}
+		//Every file must be readable before anything is wiped or allocated
+		if (!S_ISREG(attr.st_mode) || (fileid = fopen(names[j], "rb")) == NULL) {
+			fprintf(img->out, "ERROR reading file '%s'\n", plan[j].name);
+			ret = DSK_ERR_FILE;
+			goto done;
+		}
+		fclose(fileid);
+		plan[j].size = attr.st_size>img->disksize ? img->disksize : attr.st_size;
+		plan[j].mtime = attr.st_mtime;
+		pad_name(plan[j].name, plan[j].dirname);
+		//The same name given twice: the last one wins
+		for (k=0; k<(uint32_t)j; k++) {
+			if (!plan[k].skip && !memcmp(plan[k].dirname, plan[j].dirname, 11)) {
+				plan[k].skip = 1;
+				plan[j].found = 1;
+			}
+		}
+	}
+
+	//Look up the files to update in the directory index
+	for (j=0; j<num; j++) {
+		if (plan[j].isdir || (pos = dir_lookup(img, d, plan[j].dirname)) < 0) continue;
+		getfileinfo(img, dirclus, pos, &file);
+		if (file.attr&0x10) {
+			fprintf(img->out, "ERROR '%s' is a directory in the disk\n", plan[j].name);
+			ret = DSK_ERR_FILE;
+			goto done;
+		}
+		plan[j].found = 1;
+		if (!replace[pos]) {
+			replace[pos] = 1;
+			map = get_extents(img, &file);
+			for (i=0; i<map->num; i++)
+				reclaimed += map->runs[i].count;
+			freeslots++;
+		}
+	}
+	for (i=0; i<d->entries; i++) {
+		dir = dir_entry(img, d, i);
+		if ((uint8_t)dir->name[0]<0x20 || (uint8_t)dir->name[0]>=0x80)
+			freeslots++;
+	}
+
+	for (j=0; j<num; j++) {
+		if (plan[j].isdir) continue;
+		fprintf(img->out, plan[j].found ? "updating " : "  adding ");
+		for (p=plan[j].name; *p; p++) {
+			fputc(toupper(*p), img->out);
+		}
+		fputc('\n', img->out);
+		if (plan[j].skip) continue;
+		needed += (plan[j].size+img->bytespercluster-1)/img->bytespercluster;
+		slots++;
+	}
+
+	//Check the space and the directory entries once for all the files
+	if (slots>freeslots && !dirclus) {
+		fprintf (img->out, "Root directory full\n");
+		ret = DSK_ERR_DIRFULL;
+		goto done;
+	}
+	//A subdirectory grows with new clusters
+	if (slots>freeslots)
+		needed += (slots-freeslots+perclus-1)/perclus;
+	if (needed>img->freeclusters+reclaimed) {
+		fprintf (img->out, "disk full\n");
+		ret = DSK_ERR_DISKFULL;
+		goto done;
+	}
+
+	//Nothing has been touched until here
+	for (i=0; i<d->entries; i++) {
+		if (replace[i] && getfileinfo(img, dirclus, i, &file))
+			wipe(img, &file);
+	}
+
+	//Allocate the directory entries and the cluster chains up front
+	pos = 0;
+	current = img->nextfree;
+	for (j=0; j<num; j++) {
+		if (plan[j].skip) continue;
+		if ((pos = dir_free_slot(img, d, pos)) < 0) {
+			fprintf (img->out, "Internal error\n");
+			ret = DSK_ERR_INTERNAL;
+			goto done;
+		}
+		dir = dir_entry(img, d, pos);
+
+		total = (plan[j].size+img->bytespercluster-1)/img->bytespercluster;
+		if (img->allocpolicy==ALLOC_BESTFIT && total)
+			current = (k=find_best_run(img, total)) ? k : img->nextfree;
+		plan[j].first = prev = 0;
+		for (k=0; k<total; k++) {
+			if (!(current = find_free(img, current))) {
+				fprintf (img->out, "Internal error\n");
+				ret = DSK_ERR_INTERNAL;
+				goto done;
+			}
+			if (prev)
+				store_fat (img, prev, current);
+			else
+				plan[j].first = current;
+			store_fat (img, current, img->fateoc);
+			prev = current++;
+		}
+
+		//Adding directory entry
+		memset(dir, 0, 32);
+		memcpy(dir->name, plan[j].dirname, 11);
+		dir->cluini = plan[j].first;
+		dir->fsize = plan[j].size;
+		set_entry_time(dir, plan[j].mtime);
+		if (!plan[j].found) {
+			dir->ctime = dir->mtime;
+			dir->cdate = dir->mdate;
+		}
+		mark_dirty(img, dir, sizeof(direntry_t));
+		index_add(img, d, pos);
+		drop_extents(img, plan[j].first);
+
+		getfileinfo(img, dirclus, pos, &file);
+		plan[j].map = get_extents(img, &file);
+	}
+
+	//Copy the data of all the files (no stale cached copy is kept for a cached image)
+	for (j=0; j<num && img->dskcached; j++) {
+		if (plan[j].skip) continue;
+		for (i=0; i<plan[j].map->num; i++) {
+			cache_drop(img, img->cluster+(plan[j].map->runs[i].start-2)*img->bytespercluster,
+				plan[j].map->runs[i].count*img->bytespercluster);
+		}
+	}
+	read_plan(img, plan, num);
+	for (j=0; j<num; j++) {
+		if (plan[j].skip) continue;
+		if (plan[j].status) {
+			fprintf(img->out, "ERROR reading file '%s'\n", plan[j].name);
+			ret = DSK_ERR_FILE;
+		}
+		for (i=0; i<plan[j].map->num && !img->dskcached; i++) {
+			mark_dirty(img, img->cluster+(plan[j].map->runs[i].start-2)*img->bytespercluster,
+				plan[j].map->runs[i].count*img->bytespercluster);
+		}
+	}
+
+	//Then the host directories, each one with all its contents
+	for (j=0; j<num && !ret; j++) {
+		if (plan[j].isdir)
+			ret = add_host_dir(img, dirclus, plan[j].fullname, plan[j].name);
+	}
+
+done:
+	cache_trim(img);
+	free(replace);
+	free(plan);
+	return ret;
+}
+
+// Check that a file of the DSK holds the same data as a host file
+static int same_contents (DskImage *img, fileinfo_t *file, char *name) {
+	extentmap_t *map = get_extents(img, file);
+	uint8_t     *buf, *src;
+	uint32_t     i, len, off, n, pos = 0;
+	FILE        *host;
+	int          same = 1;
+
+	if ((host = fopen(name, "rb")) == NULL) return 0;
+	//Compared one cache block at a time, so a cached image stays in its budget
+	buf = (uint8_t *) malloc(CACHE_BLOCK);
+	for (i=0; same && i<map->num && pos<file->size; i++) {
+		len = map->runs[i].count*img->bytespercluster;
+		if (len > file->size-pos) len = file->size-pos;
+		src = img->cluster+(map->runs[i].start-2)*img->bytespercluster;
+		for (off=0; same && off<len; off+=n) {
+			n = len-off<CACHE_BLOCK ? len-off : CACHE_BLOCK;
+			cache_load(img, src+off, n);
+			same = fread(buf, 1, n, host) == n && !memcmp(src+off, buf, n);
+			cache_trim(img);
+		}
+		pos += len;
+	}
+	fclose(host);
+	free(buf);
+	return same && pos==file->size;
+}
+
+// Add to the root directory only the host files that differ from their copy in the DSK: another size,
+// or another modification time and contents. Nothing is written when every file is up to date.
+int sync_files (DskImage *img, char **names, int num) {
+	dskdir_t   *d = get_dir(img, 0);
+	fileinfo_t  file;
+	direntry_t  stamp;
+	struct stat attr;
+	uint8_t     padded[11];
+	char      **changed, base[250], *name, *p;
+	int         j, pos, n = 0, ret = DSK_OK;
+
+	changed = (char **) malloc(num * sizeof(char *) + 1);
+	for (j=0; j<num; j++) {
+		if (stat(names[j], &attr) || !S_ISREG(attr.st_mode)) {
+			fprintf(img->out, "ERROR reading '%s' file\n", names[j]);
+			free(changed);
+			return DSK_ERR_FILE;
+		}
+		strncpy(base, names[j], sizeof(base)-1);
+		base[sizeof(base)-1] = 0;
+		name = basename(base);
+		pad_name(name, padded);
+		if ((pos = dir_lookup(img, d, padded)) >= 0 && getfileinfo(img, 0, pos, &file) &&
+		    !(file.attr&0x10) && file.size == (uint64_t)attr.st_size) {
+			set_entry_time(&stamp, attr.st_mtime);
+			if ((stamp.mtime == dir_entry(img, d, pos)->mtime && stamp.mdate == dir_entry(img, d, pos)->mdate) ||
+			    same_contents(img, &file, names[j])) {
+				fprintf(img->out, "unchanged ");
+				for (p=name; *p; p++) {
+					fputc(toupper(*p), img->out);
+				}
+				fputc('\n', img->out);
+				continue;
+			}
+		}
+		changed[n++] = names[j];
+	}
+	if (n) ret = add_files(img, 0, changed, n);
+	free(changed);
+	return ret;
+}
+
+// Add a host directory and everything inside it to a directory of the DSK
+static int add_host_dir (DskImage *img, uint16_t parent, char *path, char *name) {
+	DIR           *hostdir;
+	struct dirent *ent;
+	char         **names = NULL;
+	int            num = 0, max = 0, i, ret;
+	uint16_t       sub;
+
+	if ((hostdir = opendir(path)) == NULL) {
+		fprintf(img->out, "ERROR reading '%s' directory\n", path);
+		return DSK_ERR_FILE;
+	}
+	if ((ret = make_dir(img, parent, name, &sub))) {
+		closedir(hostdir);
+		return ret;
+	}
+	while ((ent = readdir(hostdir)) != NULL) {
+		if (ent->d_name[0]=='.') continue;
+		if (num == max) {
+			max = max ? max*2 : 16;
+			names = (char **) realloc(names, max * sizeof(char *));
+		}
+		names[num] = (char *) malloc(strlen(path)+strlen(ent->d_name)+2);
+		sprintf(names[num++], "%s/%s", path, ent->d_name);
+	}
+	closedir(hostdir);
+
+	ret = add_planned(img, sub, names, num, 1);
+	for (i=0; i<num; i++) {
+		free(names[i]);
+	}
+	free(names);
+	return ret;
+}
+
+// Create a subdirectory in a directory of the DSK, or get the one already there
+int make_dir (DskImage *img, uint16_t parent, char *name, uint16_t *dir) {
+	dskdir_t   *d = get_dir(img, parent);
+	direntry_t *e, *sub;
+	uint8_t     padded[11];
+	uint32_t    c;
+	char       *p;
+	int         pos;
+	time_t      now = time(NULL);
+
+	pad_name(name, padded);
+	if ((pos = dir_lookup(img, d, padded)) >= 0) {
+		e = dir_entry(img, d, pos);
+		if (!(e->attr&0x10)) {
+			fprintf(img->out, "ERROR '%s' is a file in the disk\n", name);
+			return DSK_ERR_FILE;
+		}
+		*dir = e->cluini;
+		return DSK_OK;
+	}
+
+	fputs("creating ", img->out);
+	for (p=name; *p; p++) {
+		fputc(toupper(*p), img->out);
+	}
+	fputs("\\\n", img->out);
+	if (!img->freeclusters) {
+		fprintf (img->out, "disk full\n");
+		return DSK_ERR_DISKFULL;
+	}
+	if ((pos = dir_free_slot(img, d, 0)) < 0 || !(c = find_free(img, img->nextfree))) {
+		fprintf (img->out, parent ? "disk full\n" : "Root directory full\n");
+		return parent ? DSK_ERR_DISKFULL : DSK_ERR_DIRFULL;
+	}
+
+	//New directory cluster with the . and .. entries
+	store_fat(img, c, img->fateoc);
+	sub = (direntry_t *) (img->cluster+(c-2)*img->bytespercluster);
+	cache_load(img, sub, img->bytespercluster);
+	memset(sub, 0, img->bytespercluster);
+	memset(sub[0].name, ' ', 11);
+	sub[0].name[0] = '.';
+	sub[0].attr = 0x10;
+	sub[0].cluini = c;
+	set_entry_time(&sub[0], now);
+	sub[0].ctime = sub[0].mtime;
+	sub[0].cdate = sub[0].mdate;
+	sub[1] = sub[0];
+	sub[1].name[1] = '.';
+	sub[1].cluini = parent;
+	mark_dirty(img, sub, img->bytespercluster);
+
+	//Directory entry in the parent
+	e = dir_entry(img, d, pos);
+	*e = sub[0];
+	memcpy(e->name, padded, 11);
+	mark_dirty(img, e, sizeof(direntry_t));
+	index_add(img, d, pos);
+	*dir = c;
+	return DSK_OK;
+}
+
+// Create all the directories of a path that don't exist yet
+int make_dirs (DskImage *img, char *path) {
+	char     part[256];
+	size_t   len;
+	uint16_t dir = 0;
+	int      ret;
+
+	while (*path) {
+		len = strcspn(path, "/\\");
+		if (len && len<sizeof(part)) {
+			memcpy(part, path, len);
+			part[len] = 0;
+			if ((ret = make_dir(img, dir, part, &dir))) return ret;
+		}
+		path += len;
+		if (*path) path++;
+	}
+	return DSK_OK;
+}
+
+// Get the first cluster of the directory at a path (separated by / or \)
+int find_path (DskImage *img, char *path, uint16_t *dir) {
+	char        part[256];
+	uint8_t     padded[11];
+	dskdir_t   *d;
+	direntry_t *e = NULL;
+	size_t      len;
+	int         pos;
+
+	*dir = 0;
+	while (*path) {
+		len = strcspn(path, "/\\");
+		if (len && len<sizeof(part)) {
+			memcpy(part, path, len);
+			part[len] = 0;
+			memset(padded, ' ', 11);
+			if (!strcmp(part, ".") || !strcmp(part, ".."))
+				memcpy(padded, part, len);
+			else
+				pad_name(part, padded);
+			d = get_dir(img, *dir);
+			if (!strcmp(part, "..") && !*dir) {
+				//The root directory is its own parent
+			} else if (strcmp(part, ".")) {
+				if (d == NULL || (pos = dir_lookup(img, d, padded)) < 0 || !((e = dir_entry(img, d, pos))->attr&0x10)) {
+					fprintf(img->out, "ERROR directory '%s' not found\n", part);
+					return DSK_ERR_FILE;
+				}
+				*dir = e->cluini;
+			}
+		}
+		path += len;
+		if (*path) path++;
+	}
+	return DSK_OK;
+}
+
+// Split a path into the first cluster of its directory and the last name (or pattern)
+int split_path (DskImage *img, char *path, uint16_t *dir, char **name) {
+	char  dirpath[256];
+	char *p = path+strlen(path);
+
+	while (p>path && p[-1]!='/' && p[-1]!='\\')
+		p--;
+	*name = p;
+	*dir = 0;
+	if (p==path) return DSK_OK;
+	if ((size_t)(p-path) >= sizeof(dirpath)) return DSK_ERR_FILE;
+	memcpy(dirpath, path, p-path);
+	dirpath[p-path] = 0;
+	return find_path(img, dirpath, dir);
+}
+
+// Show floppy disk info
+void show_info (DskImage *img) {
+	bootsec_t *bootsec = img->bootsec;
+	FILE *out = img->out;
+
+	uint32_t i;
+
+	if (img->numparts) {
+		fprintf(out, "PARTITIONS:\n");
+		for (i=0; i<img->numparts; i++) {
+			fprintf(out, "  %c %2u  Type %02Xh  Sectors %u-%u (%uKb)\n", i+1==img->partition?'*':' ', i+1,
+				img->parts[i].type, img->parts[i].start, img->parts[i].start+img->parts[i].sectors-1, img->parts[i].sectors/2);
+		}
+		fprintf(out, "\n");
+	}
+	fprintf(out, "BOOT SECTOR INFO:\n");
+	fprintf(out, "    OEM Name...............   \"%8s\"\n", bootsec->oemname);
+	fprintf(out, "  BIOS PARAMETER BLOCK:\n");
+	fprintf(out, "    Bytes x Sector......... % 5d bytes\n", bootsec->bytesPerSector);
+	fprintf(out, "    Sectors x Cluster...... % 5d sectors\n", bootsec->sectorsPerCluster);
+	fprintf(out, "    Reserved Sectors....... % 5d sectors\n", bootsec->reservedSectors);
+	fprintf(out, "    Number of FATs......... % 5d\n", bootsec->numberOfFATs);
+	fprintf(out, "    Max root entries....... % 5d files\n", bootsec->maxDirectoryEntries);
+	fprintf(out, "    Total Sectors.......... %5u sectors\n", img->totalsectors);
+	fprintf(out, "    Media descriptor.......   %02Xh\n", bootsec->mediaDescriptor);
+	fprintf(out, "    Sectors x FAT.......... % 5d sectors\n", bootsec->sectorsPerFAT);
+	fprintf(out, "    Sectors x Track........ % 5d sectors\n", bootsec->sectorsPerTrack);
+	fprintf(out, "    Number of Heads........ % 5d heads\n", bootsec->numberOfHeads);
+	fprintf(out, "    Hidden Sectors......... % 5d sectors\n", bootsec->hiddenSectors);
+	fprintf(out, "    FAT type...............   %s\n", img->fat16?"FAT16":"FAT12");
+	fprintf(out, "\n");
+
+	long fatini = img->fat - img->dskimage;
+	long fatsize = bootsec->sectorsPerFAT * bootsec->bytesPerSector;
+
+	long rootini = (uint8_t *)img->rootdir-img->dskimage;
+	long clusterini = img->cluster - img->dskimage;
+
+	fprintf(out, "Boot sector offset.........       0 (size: 512 bytes)\n");
+	fprintf(out, "FAT#1 offset............... %7ld-%ld (size: %ld bytes)\n", fatini, fatini+fatsize-1, fatsize);
+
+	if (bootsec->numberOfFATs > 1) {
+		fprintf(out, "FAT#2 offset............... %7ld-%ld (size: %ld bytes) ", fatini+fatsize, fatini+fatsize*2-1, fatsize);
+		char fatfail = 0;
+		for (int i=0; i<fatsize; i++) {
+			if (img->dskimage[fatini+i] != img->dskimage[fatini+fatsize+i]) fatfail++;
+		}
+		if (fatfail)
+			fprintf(out, "[ERROR not equal FATs]\n");
+		else
+			fprintf(out, "[OK identical FAT copy]\n");
+	}
+	fprintf(out, "Root dir offset............ %7ld-%ld (size: %ld bytes)\n", rootini, clusterini-1, clusterini-rootini);
+	fprintf(out, "Clusters offset............ %7ld-%ld (size: %ld bytes)\n", clusterini, (long)img->disksize-1, img->disksize-clusterini);
+
+	fprintf(out, "\n%u bytes free\n\n",bytes_free(img));
+}
+
+// Filesystem check: clusters reached from the directory tree, and the ones of the chain being walked
+typedef struct {
+	uint8_t  *seen;
+	uint8_t  *chain;
+	uint16_t *list;						// Clusters of the chain being walked
+	uint8_t   repair;
+	uint32_t  errors, fixed;
+	uint32_t  files, dirs, used;
+} fsck_t;
+
+// Report a problem of the filesystem, counting it as fixed in repair mode
+static void check_error (DskImage *img, fsck_t *c, const char *path, const char *msg, ...) {
+	va_list args;
+
+	fprintf(img->out, "%s: ", path);
+	va_start(args, msg);
+	vfprintf(img->out, msg, args);
+	va_end(args);
+	fprintf(img->out, "%s\n", c->repair ? " [fixed]" : "");
+	c->errors++;
+	if (c->repair) c->fixed++;
+}
+
+// Make a cluster the end of its chain (0: the entry loses its whole chain)
+static void cut_chain (DskImage *img, direntry_t *entry, uint32_t last) {
+	if (last) {
+		store_fat(img, last, img->fateoc);
+	} else {
+		entry->cluini = 0;
+		mark_dirty(img, entry, sizeof(direntry_t));
+	}
+}
+
+// Walk the chain of a directory entry marking its clusters, returns how many it has (0 if it's damaged)
+static uint32_t check_chain (DskImage *img, fsck_t *c, direntry_t *entry, char *path) {
+	uint32_t bpc = img->bytespercluster;
+	uint32_t clus = entry->cluini, prev = 0, next, n = 0, i;
+	uint32_t needed = (entry->fsize+bpc-1) / bpc;
+	uint8_t  isdir = entry->attr&0x10, damaged = 0, longer = 0;
+
+	if (clus==1 || clus>=2+img->fatelements) {
+		check_error(img, c, path, "bad first cluster %u", clus);
+		if (c->repair) cut_chain(img, entry, 0);
+		clus = 0;
+		damaged = 1;
+	}
+	while (clus) {
+		if (c->seen[clus>>3] & (1<<(clus&7))) {
+			check_error(img, c, path, (c->chain[clus>>3] & (1<<(clus&7))) ? "loop back to cluster %u" : "cross-linked at cluster %u", clus);
+			if (c->repair) cut_chain(img, entry, prev);
+			damaged = 1;
+			break;
+		}
+		//The clusters past the size are left out of the chain (and then freed as lost)
+		if (!isdir && n==needed) {
+			longer = 1;
+			if (c->repair) {
+				cut_chain(img, entry, prev);
+				break;
+			}
+		}
+		c->seen[clus>>3] |= 1<<(clus&7);
+		c->chain[clus>>3] |= 1<<(clus&7);
+		c->list[n++] = clus;
+		next = next_link(img, clus);
+		if (next >= (img->fateoc&~7u)) break;
+		if (next<2 || next>=2+img->fatelements) {
+			check_error(img, c, path, "broken chain at cluster %u (link %03Xh)", clus, next);
+			if (c->repair) store_fat(img, clus, img->fateoc);
+			damaged = 1;
+			break;
+		}
+		prev = clus;
+		clus = next;
+	}
+	for (i=0; i<n; i++)
+		c->chain[c->list[i]>>3] &= ~(1<<(c->list[i]&7));
+	c->used += n;
+
+	if (longer)
+		check_error(img, c, path, "chain longer than its size (%u bytes)", entry->fsize);
+	else if (!isdir && n<needed) {
+		check_error(img, c, path, "size %u bytes bigger than its %u clusters", entry->fsize, n);
+		if (c->repair) {
+			entry->fsize = n*bpc;
+			mark_dirty(img, entry, sizeof(direntry_t));
+		}
+	}
+	return damaged ? 0 : n;
+}
+
+// Check the entries of a directory and everything below it
+static void check_dir (DskImage *img, fsck_t *c, uint16_t dirclus, char *path) {
+	dskdir_t   *d = get_dir(img, dirclus);
+	direntry_t *entry;
+	size_t      len = strlen(path);
+	uint32_t    i, k;
+	uint8_t    *name;
+	char       *p;
+
+	for (i=0; d!=NULL && i<d->entries; i++) {
+		entry = dir_entry(img, d, i);
+		name = (uint8_t *)entry;
+		for (k=0; k<11 && name[k]>=0x20 && name[k]<0x80; k++);
+		if (k<11 || name[0]=='.' || (entry->attr&0x08)) continue;
+
+		//Path of the entry for the messages
+		p = path+len;
+		*p++ = '\\';
+		for (k=0; k<8 && entry->name[k]!=' '; k++) *p++ = entry->name[k];
+		if (entry->ext[0]!=' ') *p++ = '.';
+		for (k=0; k<3 && entry->ext[k]!=' '; k++) *p++ = entry->ext[k];
+		*p = 0;
+
+		if (entry->attr&0x10) {
+			c->dirs++;
+			if (check_chain(img, c, entry, path) && len<200)
+				check_dir(img, c, entry->cluini, path);
+		} else {
+			c->files++;
+			check_chain(img, c, entry, path);
+		}
+		path[len] = 0;
+	}
+	//The entries are taken again through dir_entry, so the blocks of a finished directory can go
+	cache_trim(img);
+}
+
+// Check the FAT against the directory tree in a single pass over the chains: cross-linked clusters,
+// loops, broken chains, bad first clusters, sizes not matching the chains and lost clusters
+int check_dsk (DskImage *img, uint8_t repair) {
+	bootsec_t *bootsec = img->bootsec;
+	uint32_t   fatsize = bootsec->sectorsPerFAT * bootsec->bytesPerSector;
+	uint32_t   total = 2+img->fatelements, lost = 0, chains = 0, i, k, next;
+	char       path[256] = "";
+	fsck_t     c;
+
+	memset(&c, 0, sizeof(c));
+	c.repair = repair;
+	c.seen = (uint8_t *) calloc((total+7)/8, 1);
+	c.chain = (uint8_t *) calloc((total+7)/8, 1);
+	c.list = (uint16_t *) malloc(total * sizeof(uint16_t));
+
+	for (k=1; k<bootsec->numberOfFATs; k++) {
+		if (memcmp(img->fat, img->fat+k*fatsize, fatsize))
+			check_error(img, &c, "FAT", "copy #%u differs from FAT#1", k+1);
+	}
+	check_dir(img, &c, 0, path);
+
+	//Clusters in use not reached from any entry, the chains counted by their heads
+	for (i=2; i<total; i++) {
+		next = next_link(img, i);
+		if ((c.seen[i>>3] & (1<<(i&7))) || !next || next==img->fatbad) continue;
+		lost++;
+		if (next>=2 && next<total) c.chain[next>>3] |= 1<<(next&7);
+	}
+	for (i=2; i<total && lost; i++) {
+		next = next_link(img, i);
+		if ((c.seen[i>>3] & (1<<(i&7))) || !next || next==img->fatbad) continue;
+		if (!(c.chain[i>>3] & (1<<(i&7)))) chains++;
+	}
+	if (lost) {
+		check_error(img, &c, "FAT", "%u lost clusters in %u chains", lost, chains);
+		for (i=2; repair && i<total; i++) {
+			next = next_link(img, i);
+			if (!(c.seen[i>>3] & (1<<(i&7))) && next && next!=img->fatbad) store_fat(img, i, 0);
+		}
+	}
+	free(c.seen);
+	free(c.chain);
+	free(c.list);
+
+	fprintf(img->out, "\n%u files, %u directories, %u clusters in use, %u lost\n", c.files, c.dirs, c.used, lost);
+	if (!c.errors)
+		fprintf(img->out, "*** No errors found ***\n\n");
+	else
+		fprintf(img->out, "*** %u errors found, %u fixed ***\n\n", c.errors, c.fixed);
+	return c.errors>c.fixed ? DSK_ERR_CHECK : DSK_OK;
+}
+
+// Directory entries in access order: the files matching each pattern in turn, then (if rest) all the others
+static uint32_t order_files (DskImage *img, pattern_t *pats, int num, uint8_t rest, uint16_t *order) {
+	diriter_t  it;
+	fileinfo_t file;
+	uint8_t   *used;
+	uint32_t   count = 0;
+	int        i;
+
+	used = (uint8_t *) calloc(img->bootsec->maxDirectoryEntries, 1);
+	for (i=0; i<=num; i++) {
+		if (i==num && !rest) break;
+		dir_first(img, &it);
+		while (dir_next(img, &it, &file)) {
+			if (used[file.pos]) continue;
+			if (i<num && !match_pattern(entry_name(img, 0, file.pos), &pats[i])) continue;
+			used[file.pos] = 1;
+			order[count++] = file.pos;
+		}
+	}
+	free(used);
+	return count;
+}
+
+// Check that the boot sector gives a drive geometry to simulate (hard-disk volumes often have none)
+static int sim_geometry (DskImage *img) {
+	if (img->bootsec->sectorsPerTrack && img->bootsec->numberOfHeads) return 1;
+	fputs("No drive geometry in the boot sector (0 sectors per track or heads)\n", img->out);
+	return 0;
+}
+
+// Read a run of logical sectors in the drive model, advancing the simulated time
+static void sim_read (DskImage *img, fdcsim_t *sim, uint32_t sector, uint32_t count) {
+	uint32_t spt = img->bootsec->sectorsPerTrack;
+	uint32_t heads = img->bootsec->numberOfHeads;
+	uint32_t rotation = 60000000/FDC_RPM;
+	uint32_t sectortime = rotation/spt;
+	uint32_t track, angle, start;
+
+	for (; count; count--, sector++) {
+		//Step the head to the track (the head select is free)
+		track = sector/(spt*heads);
+		if (track != sim->track) {
+			sim->time += (track>sim->track ? track-sim->track : sim->track-track)*FDC_STEP_US + FDC_SETTLE_US;
+			sim->track = track;
+			sim->seeks++;
+		}
+		//Wait for the sector to pass under the head and read it
+		angle = sim->time % rotation;
+		start = (sector%spt)*sectortime;
+		sim->time += (start>=angle ? start-angle : rotation-angle+start) + sectortime;
+	}
+}
+
+// Simulate the reads of a file stored in the given runs of clusters
+static void sim_file (DskImage *img, fdcsim_t *sim, fileinfo_t *file, extent_t *runs, uint16_t num) {
+	uint32_t spc = img->bootsec->sectorsPerCluster;
+	uint32_t first = (img->cluster-img->dskimage)/img->bootsec->bytesPerSector;
+	uint32_t sectors = (file->size+img->bootsec->bytesPerSector-1)/img->bootsec->bytesPerSector;
+	uint32_t n, i;
+
+	for (i=0; i<num && sectors; i++) {
+		n = runs[i].count*spc < sectors ? runs[i].count*spc : sectors;
+		sim_read(img, sim, first+(runs[i].start-2)*spc, n);
+		sectors -= n;
+	}
+}
+
+// Clusters used by a file chain
+static uint32_t chain_clusters (DskImage *img, fileinfo_t *file) {
+	extentmap_t *map = get_extents(img, file);
+	uint32_t     i, n = 0;
+
+	for (i=0; i<map->num; i++)
+		n += map->runs[i].count;
+	return n;
+}
+
+// Choose the start cluster of every file of the order list. The first "count" files (the access
+// order) go one by one where the simulated drive ends reading them first, leaving a gap of up to
+// one cylinder when it saves a seek or rotational latency; the others are packed after them.
+static void plan_placement (DskImage *img, uint16_t *order, uint32_t files, uint32_t count, uint16_t *starts) {
+	fdcsim_t   sim, best, trial;
+	fileinfo_t file;
+	extent_t   run;
+	uint32_t   cylinder = img->bootsec->sectorsPerTrack*img->bootsec->numberOfHeads/img->bootsec->sectorsPerCluster;
+	uint32_t   k, s, n, next = 2, spare = img->fatelements;
+
+	for (k=0; k<files; k++) {
+		getfileinfo(img, 0, order[k], &file);
+		spare -= chain_clusters(img, &file);
+	}
+	memset(&sim, 0, sizeof(sim));
+	for (k=0; k<files; k++) {
+		getfileinfo(img, 0, order[k], &file);
+		n = chain_clusters(img, &file);
+		starts[k] = n ? next : 0;
+		if (!n) continue;
+		if (k<count) {
+			best = sim;
+			best.time = (uint64_t)-1;
+			run.count = n;
+			for (s=next; s<next+cylinder && s-next<=spare; s++) {
+				trial = sim;
+				run.start = s;
+				sim_file(img, &trial, &file, &run, 1);
+				if (trial.time < best.time) {
+					best = trial;
+					starts[k] = s;
+				}
+			}
+			spare -= starts[k]-next;
+			sim = best;
+		}
+		next = starts[k]+n;
+	}
+}
+
+// Rewrite the image so every file is a single run of clusters from cluster 2: the files matching
+// the patterns first and in that order, then the others in directory order. With place set, the
+// files matching the patterns are laid out with the placement suggested by the load time simulator.
+int defrag_dsk (DskImage *img, pattern_t *pats, int num, uint8_t place) {
+	diriter_t    it;
+	fileinfo_t   file;
+	extentmap_t *map;
+	uint16_t    *order, *starts;
+	uint8_t     *data, *src, *dst;
+	uint32_t     i, j, k, n, next, end = 2, files, count, moved = 0;
+	uint32_t     bpc = img->bytespercluster;
+
+	//The chains are moved in a copy of the whole data area, too big for an image read on demand
+	if (img->dskcached) {
+		fputs("Images bigger than a floppy can't be packed\n", img->out);
+		return DSK_ERR_FORMAT;
+	}
+	//Only a flat root directory without bad clusters can be packed
+	dir_first(img, &it);
+	while (dir_next(img, &it, &file)) {
+		if (file.attr&0x10) {
+			fputs("Subdirectories are not supported\n", img->out);
+			return DSK_ERR_FORMAT;
+		}
+		moved += chain_clusters(img, &file);
+	}
+	if (moved>img->fatelements) {
+		fputs("Cross-linked files, can't pack the disk\n", img->out);
+		return DSK_ERR_FORMAT;
+	}
+	moved = 0;
+	for (i=2; i<2+img->fatelements; i++) {
+		if (next_link(img, i)==img->fatbad) {
+			fputs("Disk has bad clusters\n", img->out);
+			return DSK_ERR_FORMAT;
+		}
+	}
+	if (place && !sim_geometry(img)) return DSK_ERR_FORMAT;
+	order = (uint16_t *) malloc(img->bootsec->maxDirectoryEntries * sizeof(uint16_t));
+	starts = (uint16_t *) malloc(img->bootsec->maxDirectoryEntries * sizeof(uint16_t));
+	count = place ? order_files(img, pats, num, 0, order) : 0;
+	files = order_files(img, pats, num, 1, order);
+	plan_placement(img, order, files, count, starts);
+
+	//Copy the chains to their new places in a copy of the data area
+	data = (uint8_t *) malloc(img->fatelements*bpc);
+	cache_load(img, img->cluster, img->fatelements*bpc);
+	memcpy(data, img->cluster, img->fatelements*bpc);
+	for (k=0; k<files; k++) {
+		getfileinfo(img, 0, order[k], &file);
+		map = get_extents(img, &file);
+		next = starts[k];
+		for (i=0; i<map->num; i++) {
+			for (j=0; j<map->runs[i].count; j++, next++) {
+				if (map->runs[i].start+j != next) moved++;
+				memcpy(data+(next-2)*bpc, img->cluster+(map->runs[i].start+j-2)*bpc, bpc);
+			}
+		}
+	}
+
+	//Rebuild the FAT with one chain per file and fix the initial clusters
+	for (i=2; i<2+img->fatelements; i++)
+		store_fat(img, i, 0);
+	for (k=0; k<files; k++) {
+		getfileinfo(img, 0, order[k], &file);
+		n = chain_clusters(img, &file);
+		drop_extents(img, file.first);
+		if (!n) continue;
+		next = starts[k];
+		if (img->rootdir[file.pos].cluini != next) {
+			img->rootdir[file.pos].cluini = next;
+			mark_dirty(img, &img->rootdir[file.pos], sizeof(direntry_t));
+		}
+		for (i=1; i<n; i++, next++)
+			store_fat(img, next, next+1);
+		store_fat(img, next++, img->fateoc);
+		end = next;
+	}
+	free(starts);
+	free(order);
+
+	//Only the clusters whose content changed are written back
+	for (i=2; i<end; i++) {
+		src = data+(i-2)*bpc;
+		dst = img->cluster+(i-2)*bpc;
+		if (memcmp(dst, src, bpc)) {
+			memcpy(dst, src, bpc);
+			mark_dirty(img, dst, bpc);
+		}
+	}
+	free(data);
+
+	fprintf(img->out, "%u files packed in %u clusters, %u clusters moved\n", files, end-2, moved);
+	return DSK_OK;
+}
+
+// Print a file line of the load time table
+static void sim_line (DskImage *img, fileinfo_t *file, uint32_t runs, uint32_t seeks, uint64_t time) {
+	fprintf(img->out, "%-8s.%-3s %8u %5u %5u %7u.%u\n", file->name, file->ext, file->size,
+		runs, seeks, (uint32_t)(time/1000), (uint32_t)(time%1000/100));
+}
+
+// Estimate the load time of the files in access order, and optionally the time with the best placement
+void simulate_load (DskImage *img, pattern_t *pats, int num, uint8_t suggest) {
+	fdcsim_t     sim, prev;
+	fileinfo_t   file;
+	extentmap_t *map;
+	extent_t     run;
+	uint16_t    *order, *starts;
+	uint32_t     files, count, k;
+
+	if (!sim_geometry(img)) return;
+	order = (uint16_t *) malloc(img->bootsec->maxDirectoryEntries * sizeof(uint16_t));
+	count = order_files(img, pats, num, !num, order);
+	if (!count) {
+		fputs("No files found\n", img->out);
+		free(order);
+		return;
+	}
+
+	fprintf(img->out, "%u sectors/track, %u heads, %u rpm, %u ms/track step, %u ms settle\n\n",
+		img->bootsec->sectorsPerTrack, img->bootsec->numberOfHeads, FDC_RPM, FDC_STEP_US/1000, FDC_SETTLE_US/1000);
+	fputs("Name            Bytes  Runs Seeks  Time (ms)\n"
+		  "============ ======== ===== ===== ==========\n", img->out);
+	memset(&sim, 0, sizeof(sim));
+	for (k=0; k<count; k++) {
+		getfileinfo(img, 0, order[k], &file);
+		map = get_extents(img, &file);
+		prev = sim;
+		sim_file(img, &sim, &file, map->runs, map->num);
+		sim_line(img, &file, map->num, sim.seeks-prev.seeks, sim.time-prev.time);
+	}
+	fprintf(img->out, "Total                        %5u %7u.%u\n\n", sim.seeks, (uint32_t)(sim.time/1000), (uint32_t)(sim.time%1000/100));
+	if (!suggest) {
+		free(order);
+		return;
+	}
+
+	//Placement suggested for the ZP command with the same file list
+	starts = (uint16_t *) malloc(img->bootsec->maxDirectoryEntries * sizeof(uint16_t));
+	files = order_files(img, pats, num, 1, order);
+	plan_placement(img, order, files, count, starts);
+	fputs("Suggested placement (apply it with ZP and the same file list):\n\n"
+		  "Name            Bytes  Runs Seeks  Time (ms) Clusters\n"
+		  "============ ======== ===== ===== ========== =========\n", img->out);
+	memset(&sim, 0, sizeof(sim));
+	for (k=0; k<count; k++) {
+		getfileinfo(img, 0, order[k], &file);
+		run.start = starts[k];
+		run.count = chain_clusters(img, &file);
+		prev = sim;
+		sim_file(img, &sim, &file, &run, run.count?1:0);
+		fprintf(img->out, "%-8s.%-3s %8u %5u %5u %7u.%u %04Xh-%04Xh\n", file.name, file.ext, file.size,
+			run.count?1:0, sim.seeks-prev.seeks, (uint32_t)((sim.time-prev.time)/1000), (uint32_t)((sim.time-prev.time)%1000/100),
+			run.start, run.count ? run.start+run.count-1 : 0);
+	}
+	fprintf(img->out, "Total                        %5u %7u.%u\n\n", sim.seeks, (uint32_t)(sim.time/1000), (uint32_t)(sim.time%1000/100));
+	free(starts);
+	free(order);
+}
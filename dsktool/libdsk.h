@@ -0,0 +1,307 @@
+#ifndef __LIBDSK_H__
+#define __LIBDSK_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+//Format types
+#define FORMAT_360		360
+#define FORMAT_720		720
+#define FORMAT_1440		1440
+#define FORMAT_2880		2880
+
+//Params for load_dsk(...)
+#define NO_ERROR     0
+#define ERROR        1
+#define READ_ALL     0
+#define READ_BOOTFAT 1
+#define READ_WRITE   2
+
+//Cluster allocation policies for new files
+#define ALLOC_FIRSTFIT 0			// First free clusters found
+#define ALLOC_BESTFIT  1			// Smallest free run holding the whole file (first-fit if none)
+
+//Status codes returned by the library (also used as dsktool exit codes)
+#define DSK_OK            0
+#define DSK_ERR_FORMAT    1			// Unsupported format size
+#define DSK_ERR_IMAGE     2			// Bad or missing .DSK image
+#define DSK_ERR_DISKFULL  4			// Not enough free clusters
+#define DSK_ERR_INTERNAL  5			// FAT and free clusters bitmap out of sync
+#define DSK_ERR_DIRFULL   6			// No free root directory entries
+#define DSK_ERR_FILE      7			// Error reading a host file
+#define DSK_ERR_CHECK     8			// Filesystem errors found (and not repaired) by the check
+
+//Floppy drive timings for the load time simulator
+#define FDC_RPM       300			// Spindle speed
+#define FDC_STEP_US   3000			// Head step time per track (us)
+#define FDC_SETTLE_US 15000			// Head settle time after a seek (us)
+
+//Buckets of the name index of each directory
+#define DIR_HASH_SIZE 64
+
+//Sector cache for the data area of images bigger than a floppy
+#define CACHE_MIN_SIZE (2880*1024)	// Smaller images are mapped whole
+#define CACHE_BLOCK    (64*1024)	// Data area bytes read (and evicted) at once
+#define CACHE_BUDGET   (4*1024*1024)	// Default memory for the data area blocks
+
+//Default compression level of the XSA, gzip and zstd images written
+#define PACK_LEVEL 6
+
+//Partitions collected from the partition table of a hard-disk image
+#define MAX_PARTITIONS 16
+
+// MEDIA DESCRIPTOR TABLE
+// FAT-ID             F8   F9   FA   FB   FC   FD   FE   FF
+// Format code        891  892  881  882  491  492  481  482
+// Directory entries  112  112  112  112  64   112  64   112
+// Sectors / FAT      2    3    1    2    2    2    1    1
+// Sectors / track    9    9    8    8    9    9    8    8
+// Heads              1    2    1    2    1    2    1    2
+// Sectors / head     80   80   80   80   40   40   40   40
+// Sectors / cluster  2    2    2    2    1    2    1    2
+// Total sectors      720  1440 640  1280 360  720  320  640
+// Total clusters     360  720  320  640  360  360  320  320
+// Total Kbytes       360  720  320  640  180  360  160  320
+
+#pragma pack(push,1)
+
+typedef struct {
+	uint8_t   dummy[3];				// 0x000 [3]  Dummy jump instruction (e.g. 0xEB 0xFE 0x90)
+	uint8_t   oemname[8];			// 0x003 [8]  OEM Name (padded with spaces 0x20)
+	uint16_t  bytesPerSector;		// 0x00B [2]  Bytes per logical sector in powers of two (e.g. 512 0x0200)
+	uint8_t   sectorsPerCluster;	// 0x00D [1]  Logical sectors per cluster (e.g. 2 0x02)
+	uint16_t  reservedSectors;		// 0x00E [2]  Count of reserved logical sectors (e.g. 1 0x0001)
+	uint8_t   numberOfFATs;			// 0x010 [1]  Number of File Allocation Tables (e.g. 2 0x02)
+	uint16_t  maxDirectoryEntries;	// 0x011 [2]  Maximum number of FAT12 or FAT16 root directory entries (e.g. 112 0x0070)
+	uint16_t  totalSectors;			// 0x013 [2]  Total logical sectors (e.g. 1440 0x05a0)
+	uint8_t   mediaDescriptor;		// 0x015 [1]  Media descriptor: 0xf9:3.5"720Kb | 0xf8:3.5"360Kb (see previous table)
+	uint16_t  sectorsPerFAT;		// 0x016 [2]  Logical sectors per FAT (e.g. 3 0x0003)
+	uint16_t  sectorsPerTrack;		// 0x018 [2]  Physical sectors per track for disks with CHS geometry (e.g. 9 0x0009)
+	uint16_t  numberOfHeads;		// 0x01A [2]  Number of heads (e.g. 2 0x0002)
+	uint16_t  hiddenSectors;		// 0x01C [2]  Count of hidden sectors preceding the partition that contains this FAT volume (e.g. 0 0x0000)
+	uint16_t  codeEntryPorint;		// 0x01E [2]  MSX-DOS 1 code entry point for Z80 processors into MSX boot code. This is where MSX-DOS 1 machines jump to when passing control to the boot sector.
+	uint8_t   bootCode[482];		// 0x020 [-]  This location overlaps with BPB formats since DOS 3.2 or the x86 compatible boot sector code of IBM PC compatible boot sectors and will lead to a crash on the MSX machine unless special precautions have been taken such as catching the CPU in a tight loop here (opstring 0x18 0xFE for JR 0x01E).
+} bootsec_t;
+
+typedef struct {
+	char      name[8];				// 0x000 [8]  Short file name (padded with spaces). First char '0xE5' for deleted files.
+	char      ext[3];				// 0x008 [3]  Short file extension (padded with spaces)
+	uint8_t   attr;					// 0x00B [1]  File Attributes. Mask: 0x01:ReadOnly | 0x02:Hidden | 0x04:System | 0x08:Volume | 0x10:Directory | 0x20:Archive
+	uint8_t   unused1;				// 0x00C [1]  MSX-DOS 2: For a deleted file, the original first character of the filename
+	uint8_t   unused2;				// 0x00D [1]
+	uint16_t  ctime;				// 0x00E [2]  Create time: #0-4:Seconds/2 #5-10:Minuts #11-15:Hours
+	uint16_t  cdate;				// 0x010 [2]  Create date: #0-4:Day #5-8:Month #9-15:Year(0=1980)
+	uint16_t  unused3;				// 0x012 [2]
+	uint16_t  unused4;				// 0x014 [2]
+	uint16_t  mtime;				// 0x016 [2]  Last modified time: #0-4:Seconds/2 #5-10:Minuts #11-15:Hours
+	uint16_t  mdate;				// 0x018 [2]  Last modified date: #0-4:Day #5-8:Month #9-15:Year(0=1980)
+	uint16_t  cluini;				// 0x01A [2]  Initial cluster for this file
+	uint32_t  fsize;				// 0x01C [4]  File size in bytes
+} direntry_t;
+
+typedef struct {
+	char     name[9];
+	char     ext[4];
+	uint32_t size;
+	uint16_t hour,min,sec;
+	uint16_t day,month,year;
+	uint32_t first;
+	uint32_t pos;
+	uint16_t dir;					// First cluster of the directory holding the entry (0: root)
+	uint16_t attr;
+} fileinfo_t;
+
+typedef struct {
+	uint32_t pos;					// Next directory entry to decode
+	uint32_t max;
+	uint16_t dir;					// First cluster of the directory (0: root)
+} diriter_t;
+
+// Directory loaded on demand: the root directory or the cluster chain of a subdirectory
+typedef struct {
+	uint16_t  cluster;				// First cluster (0 for the root directory)
+	uint32_t  entries;
+	uint16_t *clusters;				// Clusters of a subdirectory chain
+	uint16_t *hashhead;				// Name index buckets (NULL until the first lookup)
+	uint16_t *hashnext;				// Next entry in the same bucket, for each entry
+} dskdir_t;
+
+typedef struct {
+	uint8_t  value[11];				// Upper case name and extension padded with spaces, as in direntry_t
+	uint8_t  mask[11];				// Bits to compare in each byte (0x00 for wildcards)
+} pattern_t;
+
+typedef struct {
+	uint32_t track;					// Track under the head
+	uint64_t time;					// Elapsed time (us)
+	uint32_t seeks;
+} fdcsim_t;
+
+// Partition of a hard-disk image (primary or logical)
+typedef struct {
+	uint8_t  type;					// Partition type (0x01: FAT12 | 0x04, 0x06, 0x0E: FAT16)
+	uint32_t start;					// First sector (LBA)
+	uint32_t sectors;
+} partition_t;
+
+typedef struct {
+	uint16_t start;					// First cluster of a contiguous run
+	uint16_t count;					// Number of clusters in the run
+} extent_t;
+
+typedef struct {
+	extent_t *runs;
+	uint16_t  num;
+	uint16_t  max;
+} extentmap_t;
+
+
+/*
+ADVH Format
+
+   0 -  511	(1)	Boot sector
+ 512 - 3583	(6)	Root dir (16 bytes each entry)
+3584 - 6655 (6)	???
+6656 - ...		Data
+
+FILENAME                EXT       SECINI SECSIZE
+
+A  D  V  H              Z  8  0
+41 44 56 48 20 20 20 20 5A 38 30  12 00  12      00 00
+E  Y  E  M  S  X        C  O  M
+45 59 45 4D 53 58 20 20 43 4F 4D  24 00  05      00 00
+K  A  N  J  I  6        F  N  T
+4B 41 4E 4A 49 36 20 20 46 4E 54  29 00  20      00 00
+0  0  0                 M  E  S
+30 30 30 20 20 20 20 20 4D 45 53  49 00  04      00 00
+0  0  1                 M  E  S
+30 30 31 20 20 20 20 20 4D 45 53  4D 00  01      00 00
+...
+*/
+typedef struct {
+	uint8_t  name[8];
+	uint8_t  ext[3];
+	uint16_t secini;
+	uint16_t secsize;
+	uint8_t  reserved;
+} advhDirentry_t;
+
+#pragma pack(pop)
+
+// Disk image handle: all the state of one opened image
+typedef struct {
+	FILE       *out;					// Messages output (stdout by default)
+	uint16_t    dskFormat;				// Format for new images
+	uint8_t     isADVH;
+
+	uint8_t    *dskimage;
+	uint8_t     dskmapped;
+	uint8_t    *mapbase;				// Page aligned start of the mapping
+	uint64_t    maplen;
+	uint8_t     dsknew;
+	uint8_t    *dirtymap;				// Modified sectors bitmap
+	struct pack_s *pack;				// Compressed image (XSA, gzip or zstd), decoded on demand (NULL for a plain image)
+	uint8_t     packlevel;				// Compression level when writing a compressed image
+	uint8_t     dskcached;				// Data area read on demand through the sector cache
+	uint32_t    cachebudget;			// Memory allowed for the resident data blocks (bytes)
+	uint32_t    cacheused;
+	uint8_t    *cacheres;				// Resident data blocks bitmap
+	uint32_t   *cacheprev;				// LRU list of the resident blocks (block+1, 0 for none)
+	uint32_t   *cachenext;
+	uint32_t    cachehead;				// Most recently used block (block+1)
+	uint32_t    cachetail;
+	int         dskfd;					// Image file descriptor kept open for zero-copy reads
+	bootsec_t  *bootsec;
+
+	uint8_t     partition;				// Selected partition (1..numparts), 0 for an unpartitioned image
+	uint8_t     numparts;
+	partition_t parts[MAX_PARTITIONS];
+	uint64_t    partoffset;				// Offset of the volume inside the image file
+
+	uint8_t     fat16;					// FAT16 volume (FAT12 otherwise)
+	uint16_t    fateoc;					// End of chain mark (0xFFF or 0xFFFF)
+	uint16_t    fatbad;					// Bad cluster mark (0xFF7 or 0xFFF7)
+	uint32_t    totalsectors;			// Sectors of the volume (16 or 32 bits BPB field)
+	uint8_t    *fat;
+	uint16_t   *fatcache;				// Decoded FAT: one entry per cluster
+	uint32_t    fatentries;
+	direntry_t *rootdir;
+	uint8_t    *cluster;
+	uint32_t    disksize;
+	uint32_t    fatelements;
+	uint32_t    availsectors;
+	uint32_t    bytespercluster;
+
+	extentmap_t *extentcache;			// Cached cluster runs of each chain, by its first cluster
+	dskdir_t  **dirs;					// Loaded directories, by their first cluster (root at 0)
+	char        hostpath[256];			// Host directory prefix for the extracted files
+
+	uint16_t   *clusterowner;			// Directory entry owning each cluster (entry+1, 0 for none)
+	uint16_t   *clusterindex;			// Position of each cluster inside its owner chain
+	uint16_t   *clusterdir;				// Directory holding the owner entry of each cluster
+
+	uint8_t    *freemap;				// Free clusters bitmap (bit set: free cluster)
+	uint8_t    *freedmap;				// Clusters freed since the load (released on flush)
+	uint32_t    freeclusters;
+	uint32_t    nextfree;				// All the clusters below this one are in use
+	uint8_t     allocpolicy;			// ALLOC_FIRSTFIT or ALLOC_BESTFIT
+
+	advhDirentry_t *rootADVH;
+} DskImage;
+
+typedef void (*dsk_action_t)(DskImage *img, fileinfo_t *file);
+
+
+// Image handle
+DskImage    *new_dsk (FILE *out);
+void         free_dsk (DskImage *img);
+int          load_dsk (DskImage *img, char *name, uint8_t mode, uint8_t error);
+int          flush_dsk (DskImage *img, char *name);
+int          create_overlay (DskImage *img, char *base, char *name);
+int          merge_dsk (DskImage *img, char *name, char *output);
+int          diff_dsk (DskImage *old, DskImage *img, char *name);
+int          patch_dsk (DskImage *img, char *name);
+
+// FAT access
+int          next_link (DskImage *img, uint16_t link);
+int          remove_link (DskImage *img, uint16_t link);
+void         store_fat (DskImage *img, uint16_t link, uint16_t next);
+uint32_t     bytes_free (DskImage *img);
+extentmap_t *get_extents (DskImage *img, fileinfo_t *file);
+
+// Directory access
+int          getfileinfo (DskImage *img, uint16_t dir, uint16_t entrypos, fileinfo_t *file);
+int          getfileinfoadvh (DskImage *img, uint16_t entrypos, fileinfo_t *file);
+void         dir_first (DskImage *img, diriter_t *it);
+void         dir_open (DskImage *img, diriter_t *it, uint16_t dir);
+int          dir_next (DskImage *img, diriter_t *it, fileinfo_t *file);
+dskdir_t    *get_dir (DskImage *img, uint16_t cluster);
+direntry_t  *dir_entry (DskImage *img, dskdir_t *dir, uint32_t entrypos);
+int          dir_lookup (DskImage *img, dskdir_t *dir, uint8_t *name);
+int          find_path (DskImage *img, char *path, uint16_t *dir);
+int          split_path (DskImage *img, char *path, uint16_t *dir, char **name);
+int          make_dir (DskImage *img, uint16_t parent, char *name, uint16_t *dir);
+int          make_dirs (DskImage *img, char *path);
+void         compile_pattern (char *name, pattern_t *pat);
+int          match_pattern (uint8_t *entry, pattern_t *pat);
+void         parse_tree (DskImage *img, uint16_t dir, pattern_t *pats, uint16_t num, dsk_action_t action);
+
+// Commands
+void         list_dsk (DskImage *img);
+void         list_advhdsk (DskImage *img);
+void         show_info (DskImage *img);
+int          check_dsk (DskImage *img, uint8_t repair);
+void         extract (DskImage *img, fileinfo_t *file);
+void         extract_advh (DskImage *img, fileinfo_t *file);
+void         file_clusters_info (DskImage *img, fileinfo_t *file);
+void         wipe (DskImage *img, fileinfo_t *file);
+void         deleted (DskImage *img, fileinfo_t *file);
+int          add_files (DskImage *img, uint16_t dir, char **names, int num);
+int          sync_files (DskImage *img, char **names, int num);
+void         build_owner_index (DskImage *img);
+void         offset_info (DskImage *img, uint64_t offset);
+void         offset_info_advh (DskImage *img, uint32_t offset);
+int          defrag_dsk (DskImage *img, pattern_t *pats, int num, uint8_t place);
+void         simulate_load (DskImage *img, pattern_t *pats, int num, uint8_t suggest);
+
+#endif